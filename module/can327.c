@@ -15,14 +15,27 @@
 #include <linux/init.h>
 #include <linux/module.h>
 
+#include <linux/bitmap.h>
 #include <linux/bitops.h>
+#include <linux/average.h>
 #include <linux/ctype.h>
+#include <linux/debugfs.h>
 #include <linux/errno.h>
+#include <linux/ethtool.h>
 #include <linux/kernel.h>
+#include <linux/log2.h>
+#include <linux/kfifo.h>
+#include <linux/ktime.h>
 #include <linux/list.h>
 #include <linux/lockdep.h>
+#include <linux/math64.h>
+#include <linux/moduleparam.h>
+#include <linux/mutex.h>
 #include <linux/netdevice.h>
+#include <linux/rcupdate.h>
+#include <linux/seq_file.h>
 #include <linux/skbuff.h>
+#include <linux/slab.h>
 #include <linux/spinlock.h>
 #include <linux/string.h>
 #include <linux/tty.h>
@@ -36,6 +49,12 @@
 #include <linux/can/dev.h>
 #include <linux/can/error.h>
 #include <linux/can/rx-offload.h>
+#include <linux/can/skb.h>
+
+#include "can327.h"
+
+#define CREATE_TRACE_POINTS
+#include "can327_trace.h"
 
 /* Line discipline ID number.
  * Starting with Linux v5.18-rc1, N_DEVELOPMENT is defined as 29:
@@ -48,22 +67,210 @@
 /* Compatibility for Linux < 5.11 */
 #if LINUX_VERSION_CODE < KERNEL_VERSION(5,11,0)
 #define len can_dlc
+#define in_hardirq() in_irq()
+#endif
+
+/* Compatibility for Linux < 5.12, whose echo skb helpers don't take
+ * frame lengths for BQL yet. We do our own BQL accounting anyway.
+ */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5,12,0)
+#define can327_put_echo_skb(skb, dev, idx) can_put_echo_skb(skb, dev, idx)
+#define can327_get_echo_skb(dev, idx) can_get_echo_skb(dev, idx)
+#else
+#define can327_put_echo_skb(skb, dev, idx) can_put_echo_skb(skb, dev, idx, 0)
+#define can327_get_echo_skb(dev, idx) can_get_echo_skb(dev, idx, NULL)
+#endif
+
+/* Compatibility for Linux < 5.10, which has no sysfs_emit() yet.
+ * Our attributes are all short, so plain sprintf() does.
+ */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5,10,0)
+#define sysfs_emit(buf, fmt, ...) sprintf(buf, fmt, ##__VA_ARGS__)
 #endif
 
+/* Minimum NAPI weight, used until we know better */
 #define CAN327_NAPI_WEIGHT 4
 
-#define CAN327_SIZE_TXBUF 32
+/* Room for a command, plus whatever is still waiting to be written
+ * and a dummy char to interrupt it.
+ */
+#define CAN327_SIZE_TXBUF 64
+
+/* Default, minimum and maximum RX ring buffer size. Powers of 2. */
 #define CAN327_SIZE_RXBUF 1024
+#define CAN327_SIZE_RXBUF_MIN 128
+#define CAN327_SIZE_RXBUF_MAX 65536
+
+/* Number of preallocated skbs for received frames */
+#define CAN327_SIZE_RXPOOL 32
+
+/* Number of CAN frames queued for TX. Must be a power of 2. */
+#define CAN327_SIZE_TXFIFO 16
+
+/* Number of queued CAN frames the TX scheduler may choose from,
+ * and how often it may pass over the oldest one.
+ */
+#define CAN327_SIZE_TXSCHED 8
+#define CAN327_TXSCHED_MAX_SKIPS 8
+
+/* Echo skbs: One for each frame in tx_fifo and tx_sched, and one for
+ * the frame being sent.
+ */
+#define CAN327_SIZE_ECHO (CAN327_SIZE_TXFIFO + CAN327_SIZE_TXSCHED + 1)
 
 #define CAN327_CAN_CONFIG_SEND_SFF 0x8000
 #define CAN327_CAN_CONFIG_VARIABLE_DLC 0x4000
 #define CAN327_CAN_CONFIG_RECV_BOTH_SFF_EFF 0x2000
 #define CAN327_CAN_CONFIG_BAUDRATE_MULT_8_7 0x1000
 
+/* TX scheduling policies, see can327_tx_dequeue() */
+enum can327_tx_sched_policy {
+	CAN327_TX_SCHED_FIFO = 0,
+	CAN327_TX_SCHED_GROUP,
+	CAN327_TX_SCHED_PRIO,
+	CAN327_TX_SCHED_DEADLINE,
+};
+
+static unsigned int tx_sched = CAN327_TX_SCHED_FIFO;
+module_param(tx_sched, uint, 0644);
+MODULE_PARM_DESC(tx_sched,
+		 "TX scheduling: 0 = FIFO (default), 1 = group frames by CAN ID, 2 = by CAN priority, 3 = by deadline");
+
+/* For frames without a deadline set by CAN327_IOC_SET_TX_DEADLINES */
+#define CAN327_TX_DEADLINE_DEFAULT_US USEC_PER_SEC
+
+static unsigned int rxbuf_size = CAN327_SIZE_RXBUF;
+module_param(rxbuf_size, uint, 0444);
+MODULE_PARM_DESC(rxbuf_size,
+		 "Size of the RX buffer per channel, rounded up to a power of 2");
+
+static bool spaces_off;
+module_param(spaces_off, bool, 0644);
+MODULE_PARM_DESC(spaces_off,
+		 "Receive frames without spaces (AT S0) to save UART bandwidth");
+
+static bool probe_caps = true;
+module_param(probe_caps, bool, 0644);
+MODULE_PARM_DESC(probe_caps,
+		 "Identify the chip at init, and use the features it supports");
+
+static bool stn = true;
+module_param(stn, bool, 0644);
+MODULE_PARM_DESC(stn,
+		 "Use the extended command set of STN chips (needs probe_caps)");
+
+static unsigned int uart_baudrate;
+module_param(uart_baudrate, uint, 0644);
+MODULE_PARM_DESC(uart_baudrate,
+		 "Switch the UART to this baud rate using AT BRD (0 = don't)");
+
+static unsigned int overflow_baudrate;
+module_param(overflow_baudrate, uint, 0644);
+MODULE_PARM_DESC(overflow_baudrate,
+		 "Switch the UART to this baud rate using AT BRD if the ELM327 keeps reporting BUFFER FULL (0 = don't)");
+
+static unsigned int napi_weight;
+module_param(napi_weight, uint, 0444);
+MODULE_PARM_DESC(napi_weight,
+		 "NAPI weight (0 = adapt to the number of frames per UART chunk)");
+
+static bool tx_direct;
+module_param(tx_direct, bool, 0644);
+MODULE_PARM_DESC(tx_direct,
+		 "Write to the TTY right from its wakeup callback, if the TTY driver allows it");
+
+static bool tx_combine;
+module_param(tx_combine, bool, 0644);
+MODULE_PARM_DESC(tx_combine,
+		 "Only write to the TTY once it has room for all pending data");
+
+static unsigned int reply_timeout;
+module_param(reply_timeout, uint, 0644);
+MODULE_PARM_DESC(reply_timeout,
+		 "Wait this many ms for replies after sending a frame (0 = maximum of 1020 ms)");
+
+static bool reply_timeout_adapt;
+module_param(reply_timeout_adapt, bool, 0644);
+MODULE_PARM_DESC(reply_timeout_adapt,
+		 "Learn how long replies take per CAN ID, and wait only about twice as long");
+
+/* Flushes the TTY TX buffers. Shared by all channels. */
+static struct workqueue_struct *can327_wq;
+
+/* How long to wait for the ELM327's ID after switching baud rates */
+#define CAN327_BAUD_TIMEOUT_MS 500
+
+/* AT ST counts in steps of 4 ms */
+#define CAN327_REPLY_TIMEOUT_STEP_MS 4
+#define CAN327_REPLY_TIMEOUT_MAX_MS (0xff * CAN327_REPLY_TIMEOUT_STEP_MS)
+
+/* Added to twice the learnt reply latency, to allow for jitter */
+#define CAN327_REPLY_MARGIN_MS 20
+
+/* Number of CAN IDs whose reply latency is tracked */
+#define CAN327_SIZE_REPLY_TIMES 8
+
+/* This many BUFFER FULLs within the window mean the UART is too slow */
+#define CAN327_OVERFLOW_BURST 4
+#define CAN327_OVERFLOW_WINDOW_MS 10000
+
 #define CAN327_DUMMY_CHAR 'y'
 #define CAN327_DUMMY_STRING "y"
 #define CAN327_READY_CHAR '>'
 
+/* Character classes of bytes coming from the ELM327.
+ * For hex digits, the low nibble holds their value.
+ */
+#define CAN327_CC_NIBBLE 0x0f
+#define CAN327_CC_HEX BIT(4)	/* Hex digit */
+#define CAN327_CC_SPACE BIT(5)	/* Separator in hex dumps */
+#define CAN327_CC_MSG BIT(6)	/* May start an error message */
+#define CAN327_CC_VALID BIT(7)	/* May be sent by the ELM327 at all */
+
+#define CAN327_CC_DIGIT(v) (CAN327_CC_VALID | CAN327_CC_MSG | \
+			    CAN327_CC_HEX | (v))
+#define CAN327_CC_UPPER (CAN327_CC_VALID | CAN327_CC_MSG)
+
+static const u8 can327_char_class[256] = {
+	['\r'] = CAN327_CC_VALID,
+	[' '] = CAN327_CC_VALID | CAN327_CC_SPACE,
+	[','] = CAN327_CC_VALID,	/* Echo of STN commands */
+	['.'] = CAN327_CC_VALID,
+	['0'] = CAN327_CC_DIGIT(0x0), CAN327_CC_DIGIT(0x1),
+		CAN327_CC_DIGIT(0x2), CAN327_CC_DIGIT(0x3),
+		CAN327_CC_DIGIT(0x4), CAN327_CC_DIGIT(0x5),
+		CAN327_CC_DIGIT(0x6), CAN327_CC_DIGIT(0x7),
+		CAN327_CC_DIGIT(0x8), CAN327_CC_DIGIT(0x9),
+	[':'] = CAN327_CC_VALID,	/* Echo of STN commands */
+	['<'] = CAN327_CC_VALID | CAN327_CC_MSG,
+	[CAN327_READY_CHAR] = CAN327_CC_VALID,
+	['?'] = CAN327_CC_VALID,
+	['@'] = CAN327_CC_VALID,	/* Echo of AT@1 */
+	['A'] = CAN327_CC_DIGIT(0xa), CAN327_CC_DIGIT(0xb),
+		CAN327_CC_DIGIT(0xc), CAN327_CC_DIGIT(0xd),
+		CAN327_CC_DIGIT(0xe), CAN327_CC_DIGIT(0xf),
+	['G' ... 'Z'] = CAN327_CC_UPPER,
+	/* Lower case is only used in replies to ATI, STI and AT@1,
+	 * e.g. "ELM327 v1.4b". Treat a and b as hex digits, just like
+	 * hex_to_bin() would.
+	 */
+	['a'] = CAN327_CC_VALID | CAN327_CC_HEX | 0xa,
+	['b'] = CAN327_CC_VALID | CAN327_CC_HEX | 0xb,
+	['c' ... 'z'] = CAN327_CC_VALID,
+	[CAN327_DUMMY_CHAR] = CAN327_CC_VALID,
+};
+
+/* Average number of frames parsed per pass over the RX buffer */
+DECLARE_EWMA(can327_batch, 4, 8)
+
+/* Average time from sending a frame to the first reply, in us */
+DECLARE_EWMA(can327_reply, 4, 4)
+
+struct can327_reply_time {
+	canid_t can_id;
+	struct ewma_can327_reply latency;
+};
+
 /* Bits in elm->cmds_todo */
 enum can327_tx_do {
 	CAN327_TX_DO_CAN_DATA = 0,
@@ -72,9 +279,191 @@ enum can327_tx_do {
 	CAN327_TX_DO_CANID_29BIT_HIGH,
 	CAN327_TX_DO_CAN_CONFIG_PART2,
 	CAN327_TX_DO_CAN_CONFIG,
+	CAN327_TX_DO_FC_ENABLE,
+	CAN327_TX_DO_FC_MODE,
+	CAN327_TX_DO_FC_DATA,
+	CAN327_TX_DO_FC_HEADER,
+	CAN327_TX_DO_CAN_MASK,
+	CAN327_TX_DO_CAN_PASS_FILTER,
+	CAN327_TX_DO_CAN_FILTER,
+	CAN327_TX_DO_REPLY_TIMEOUT,
 	CAN327_TX_DO_RESPONSES,
 	CAN327_TX_DO_SILENT_MONITOR,
+	CAN327_TX_DO_SPACES,
+	CAN327_TX_DO_BAUDRATE,
 	CAN327_TX_DO_INIT,
+	CAN327_TX_DO_WARM_CHECK,
+	CAN327_TX_DO_PROBE_ATI,
+	CAN327_TX_DO_PROBE_STI,
+	CAN327_TX_DO_PROBE_AT1,
+};
+
+/* Commands whose reply is evaluated */
+#define CAN327_TX_DO_PROBE_MASK (BIT(CAN327_TX_DO_PROBE_ATI) | \
+				 BIT(CAN327_TX_DO_PROBE_STI) | \
+				 BIT(CAN327_TX_DO_PROBE_AT1))
+
+/* Bits in elm->caps, as found by the probe after the init script */
+enum can327_cap {
+	CAN327_CAP_ATI = 0,	/* Identifies itself with ATI */
+	CAN327_CAP_AT1,		/* Answers AT@1 with a device description */
+	CAN327_CAP_STN,		/* STN11xx/STN2xxx extensions (STI) */
+	CAN327_CAP_BAUDRATE,	/* v1.2: AT BRD */
+	CAN327_CAP_SPACES_OFF,	/* v1.3: AT S0 */
+};
+
+/* States of the state machine in can327_parse_rxbuf() */
+enum can327_state {
+	CAN327_STATE_NOTINIT = 0,
+	CAN327_STATE_GETDUMMYCHAR,
+	CAN327_STATE_GETPROMPT,
+	CAN327_STATE_RECEIVING,
+	CAN327_STATE_BAUD_GETOK,
+	CAN327_STATE_BAUD_GETID,
+	CAN327_STATE_GETREPLY,
+};
+
+#define CAN327_NUM_STATES (CAN327_STATE_GETREPLY + 1)
+
+/* For ethtool -S */
+static const char * const can327_state_names[CAN327_NUM_STATES] = {
+	[CAN327_STATE_NOTINIT] = "notinit",
+	[CAN327_STATE_GETDUMMYCHAR] = "getdummychar",
+	[CAN327_STATE_GETPROMPT] = "getprompt",
+	[CAN327_STATE_RECEIVING] = "receiving",
+	[CAN327_STATE_BAUD_GETOK] = "baud_getok",
+	[CAN327_STATE_BAUD_GETID] = "baud_getid",
+	[CAN327_STATE_GETREPLY] = "getreply",
+};
+
+/* Kinds of error events, counted in elm->errors[] */
+enum can327_err {
+	CAN327_ERR_GARBLED = 0,		/* Not a known message */
+	CAN327_ERR_UNABLE_TO_CONNECT,
+	CAN327_ERR_BUFFER_FULL,		/* Also for frames cut short by it */
+	CAN327_ERR_BUS_ERROR,
+	CAN327_ERR_CAN_ERROR,
+	CAN327_ERR_RX_ERROR,
+	CAN327_ERR_BUS_BUSY,
+	CAN327_ERR_FB_ERROR,
+	CAN327_ERR_ERRXX,		/* ERR followed by two digits */
+	CAN327_ERR_LV_RESET,
+	CAN327_NUM_ERRS
+};
+
+/* The ELM327's error messages, and how they're reported in
+ * CAN error frames
+ */
+static const struct {
+	const char *name;	/* For ethtool -S */
+	const char *msg;
+	canid_t class;		/* CAN_ERR_* */
+	u8 crtl;		/* data[1] */
+	u8 prot;		/* data[2] */
+} can327_errs[CAN327_NUM_ERRS] = {
+	[CAN327_ERR_GARBLED] = { "garbled", NULL, 0 },
+	[CAN327_ERR_UNABLE_TO_CONNECT] = { "unable_to_connect", "UNABLE TO CONNECT", 0 },
+	[CAN327_ERR_BUFFER_FULL] = { "buffer_full", "BUFFER FULL",
+				     CAN_ERR_CRTL, CAN_ERR_CRTL_RX_OVERFLOW },
+	[CAN327_ERR_BUS_ERROR] = { "bus_error", "BUS ERROR", CAN_ERR_BUSERROR },
+	[CAN327_ERR_CAN_ERROR] = { "can_error", "CAN ERROR", CAN_ERR_PROT },
+	[CAN327_ERR_RX_ERROR] = { "rx_error", "<RX ERROR", CAN_ERR_PROT },
+	[CAN327_ERR_BUS_BUSY] = { "bus_busy", "BUS BUSY", CAN_ERR_PROT,
+				  0, CAN_ERR_PROT_OVERLOAD },
+	[CAN327_ERR_FB_ERROR] = { "fb_error", "FB ERROR", CAN_ERR_PROT,
+				  0, CAN_ERR_PROT_TX },
+	[CAN327_ERR_ERRXX] = { "errxx", NULL, CAN_ERR_CRTL },
+	[CAN327_ERR_LV_RESET] = { "lv_reset", "LV RESET", CAN_ERR_CRTL },
+};
+
+/* Minimum time between two error frames */
+#define CAN327_ERR_INTERVAL_MS 100
+
+/* Latency histograms: The first bucket is below CAN327_HIST_MIN_US,
+ * each of the others twice as wide as the one before, and the last
+ * one open ended.
+ */
+#define CAN327_HIST_BUCKETS 12
+#define CAN327_HIST_MIN_US 128
+
+/* A frame waiting in tx_fifo or tx_sched */
+struct can327_tx_frame {
+	struct can_frame frame;
+	ktime_t queued;		/* When can327_netdev_start_xmit() got it */
+	ktime_t deadline;	/* Set when it moves to tx_sched */
+	u8 echo;		/* Index of its echo skb */
+};
+
+/* The TX peers of a bonded channel, see can327_set_bond_peers() */
+struct can327_bond {
+	struct rcu_head rcu;
+	unsigned int count;
+	struct can327 *peers[CAN327_MAX_BOND_PEERS];
+};
+
+/* A frame sent through a TX peer, whose echo we expect to see while
+ * monitoring. Empty if sent is 0.
+ */
+struct can327_bond_echo {
+	struct can_frame frame;
+	ktime_t sent;
+};
+
+/* Frames sent through TX peers that we remember, and for how long.
+ * The TX peer may have to wait for its prompt a few times before its
+ * frame is on the bus.
+ */
+#define CAN327_SIZE_BOND_ECHOES 32
+#define CAN327_BOND_ECHO_MS 1000
+
+/* Protects the bond and bond_master pointers of all channels */
+static DEFINE_MUTEX(can327_bond_lock);
+
+/* Performance counters for ethtool -S and debugfs.
+ * They're updated under elm->lock, except for the UART byte counts:
+ * RX is only counted by can327_ldisc_rx(), and TX under elm->tx_lock.
+ */
+struct can327_perf {
+	u64 kicks;			/* Into command mode */
+	u64 monitor_starts;		/* AT MA, STMA */
+	u64 prompts;
+	u64 tx_prompts;			/* Spent on setting up and sending frames */
+	u64 tx_frames;			/* Sent to the ELM327 */
+	u64 rx_frames;			/* Parsed from its lines */
+	u64 rx_lines;			/* While receiving */
+	u64 rx_bytes;			/* On the UART */
+	u64 rx_busy_ns;			/* Time taken up by rx_bytes */
+	u64 tx_bytes;
+	u64 tx_busy_ns;
+	ktime_t since;			/* Counting since then */
+
+	u64 state_ns[CAN327_NUM_STATES];
+	ktime_t state_since;		/* Of the current state */
+
+	/* From start_xmit to handing the frame to the ELM327 */
+	u64 tx_latency[CAN327_HIST_BUCKETS];
+
+	/* From the <CR> of a line to queueing its frame for NAPI */
+	u64 rx_latency[CAN327_HIST_BUCKETS];
+};
+
+#define CAN327_SIZE_CHIP_ID 32
+
+/* Commands that differ between chip families */
+struct can327_backend {
+	const char *monitor;	/* Enter CAN monitor mode */
+	bool one_shot_tx;	/* Send header and data at once (STPX) */
+	bool pass_filters;	/* Multiple hardware filters (STFAP) */
+};
+
+static const struct can327_backend can327_backend_elm = {
+	.monitor = "ATMA\r",
+};
+
+static const struct can327_backend can327_backend_stn = {
+	.monitor = "STMA\r",
+	.one_shot_tx = true,
+	.pass_filters = true,
 };
 
 struct can327 {
@@ -85,11 +474,19 @@ struct can327 {
 
 	/* TTY buffers */
 	u8 txbuf[CAN327_SIZE_TXBUF];
-	u8 rxbuf[CAN327_SIZE_RXBUF];
+	u8 *rxbuf;			/* Ring buffer of rxbuf_size bytes */
+	u8 *rxline;			/* Copy of a line wrapping around */
+	unsigned long *rxcrmap;		/* Positions of <CR> in rxbuf */
+	unsigned int rxbuf_size;
 
-	/* Per-channel lock */
+	/* Per-channel lock, protecting the state machine.
+	 * Taken before tx_lock where both are needed.
+	 */
 	spinlock_t lock;
 
+	/* Protects txbuf, txhead and txleft */
+	spinlock_t tx_lock;
+
 	/* TTY and netdev devices that we're bridging */
 	struct tty_struct *tty;
 	struct net_device *dev;
@@ -98,29 +495,165 @@ struct can327 {
 	struct work_struct tx_work;	/* Flushes TTY TX buffer */
 	u8 *txhead;			/* Next TX byte */
 	size_t txleft;			/* Bytes left to TX */
-	int rxfill;			/* Bytes already RX'd in buffer */
 
-	/* State machine */
-	enum {
-		CAN327_STATE_NOTINIT = 0,
-		CAN327_STATE_GETDUMMYCHAR,
-		CAN327_STATE_GETPROMPT,
-		CAN327_STATE_RECEIVING,
-	} state;
+	/* RX ring buffer accounting.
+	 * These count up freely, and are masked when accessing rxbuf.
+	 *
+	 * can327_ldisc_rx() is the only producer, and doesn't take
+	 * elm->lock to fill the ring. Consumers hold elm->lock.
+	 */
+	unsigned int rxhead;		/* Next RX'd byte goes here */
+	unsigned int rxtail;		/* Oldest unparsed byte */
+	unsigned int rxscan;		/* Next byte to check for <CR> */
+
+	/* Parses the RX ring buffer, see can327_rx_poll() */
+	struct napi_struct rx_napi;
+
+	/* RX timestamps */
+	ktime_t *rxstamps;		/* Arrival of each <CR> in rxbuf */
+	u32 rx_byte_ns;			/* Time per byte on the UART */
+	ktime_t rxline_stamp;		/* <CR> of the line being parsed */
+
+	/* Frames queued to rx-offload, but not yet handed to NAPI */
+	unsigned int rx_batch;
+	struct ewma_can327_batch rx_batch_avg;
+
+	/* Preallocated skbs for received frames */
+	struct sk_buff_head rx_pool;
+	struct work_struct rx_pool_work;	/* Refills rx_pool */
+
+	/* State machine, see can327_set_state() */
+	enum can327_state state;
+	enum can327_tx_do reply_to;	/* Command whose reply we expect */
 
 	/* Things we have yet to send */
 	char **next_init_cmd;
 	unsigned long cmds_todo;
 
+	/* CAN frames waiting for their turn in can327_handle_prompt() */
+	DECLARE_KFIFO(tx_fifo, struct can327_tx_frame, CAN327_SIZE_TXFIFO);
+
+	/* TX scheduler window, ordered oldest first.
+	 * Frames move here from tx_fifo right before being sent.
+	 */
+	struct can327_tx_frame tx_sched[CAN327_SIZE_TXSCHED];
+	unsigned int tx_sched_len;
+	unsigned int tx_sched_skips;	/* Times tx_sched[0] was passed over */
+
+	/* Reconfigurations avoided by the TX scheduler */
+	unsigned long tx_canid_switches_saved;
+	unsigned long tx_config_switches_saved;
+
+	/* TX deadlines, as set by CAN327_IOC_SET_TX_DEADLINES */
+	struct can327_tx_deadline_list tx_deadlines;
+	unsigned long tx_deadlines_missed;	/* Frames sent late */
+
 	/* The CAN frame and config the ELM327 is sending/using,
 	 * or will send/use after finishing all cmds_todo
 	 */
 	struct can_frame can_frame_to_send;
+	ktime_t tx_queued;		/* When start_xmit got it */
+
+	/* Echo skbs in use, see can327_tx_complete().
+	 * Taken by start_xmit, and given back by the state machine.
+	 */
+	unsigned long echo_used;
+	u8 tx_echo;			/* That of can_frame_to_send */
+	bool tx_echo_pending;		/* can_frame_to_send not done yet */
+	bool tx_echo_sent;		/* ... but sent to the ELM327 */
 	u16 can_config;
 	u8 can_bitrate_divisor;
+	u8 reply_timeout;		/* AT ST, in 4 ms steps */
+
+	/* Reply latency per CAN ID, see can327_select_reply_timeout() */
+	struct can327_reply_time reply_times[CAN327_SIZE_REPLY_TIMES];
+	unsigned int next_reply_time;	/* Next entry to replace */
+	bool reply_wait;		/* Waiting for the first reply */
+	canid_t reply_wait_id;		/* ... to this frame */
+	ktime_t reply_wait_stamp;	/* ... whose echo arrived then */
+
+	/* Flow control table, as set by CAN327_IOC_SET_FLOW_CONTROL */
+	struct can327_flow_control_list fc_table;
+
+	/* Flow control for the frame being sent, if fc_on */
+	struct can327_flow_control fc;
+	bool fc_on;
+
+	/* Hardware CAN ID filters, as set by CAN327_IOC_SET_HW_FILTER(S) */
+	struct can327_hw_filter_list hw_filters;
+	unsigned int next_pass_filter;	/* Next one to send with STFAP */
+
+	/* What the ELM327 is known to be configured with.
+	 * A cmds_todo bit set in shadow_known means that its setting
+	 * is known, and the command can be skipped if it matches.
+	 */
+	struct {
+		u32 header;			/* AT SH */
+		u8 priority;			/* AT CP */
+		u16 can_config;			/* AT PB */
+		bool silent_monitor;		/* AT CSM */
+		bool responses;			/* AT R */
+		u8 reply_timeout;		/* AT ST */
+		struct can327_hw_filter_list filters;	/* AT CF/CM/CRA, STFAP */
+		struct can327_flow_control fc;		/* AT FC SH, AT FC SD */
+		bool fc_on;				/* AT CFC */
+	} shadow;
+	unsigned long shadow_known;
+	unsigned long cmds_skipped;
+
+	/* UART baud rate switching (AT BRD) */
+	struct work_struct baud_work;		/* Sets TTY to baud_next */
+	struct delayed_work baud_timeout_work;	/* Falls back to baud_old */
+	unsigned int baud_want;			/* Target of the next AT BRD */
+	unsigned int baud_next;
+	unsigned int baud_old;
+	unsigned int baud_now;			/* Confirmed by the ELM327 */
+	bool baud_failed;			/* Don't try again */
+
+	/* Error events, see can327_rx_error() */
+	unsigned long errors[CAN327_NUM_ERRS];	/* Per kind */
+	unsigned long errors_coalesced;	/* Reported in a frame with others */
+	struct can_frame err_frame;	/* Classes of the pending events */
+	unsigned int err_pending;	/* Events not reported yet */
+	unsigned long err_next;		/* jiffies when we may report again */
+	struct delayed_work err_work;	/* Reports them then */
+
+	/* Bonding, see can327_set_bond_peers() */
+	struct can327_bond __rcu *bond;		/* If we have TX peers */
+	struct can327 *bond_master;		/* If we're a TX peer */
+	struct can327_bond_echo bond_echoes[CAN327_SIZE_BOND_ECHOES];
+	unsigned int next_bond_echo;		/* Next entry to replace */
+	unsigned long bond_echoes_suppressed;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,1,0)
+	struct lock_class_key xmit_lock_key;	/* See can327_lockdep_init() */
+	struct lock_class_key busylock_key;
+#endif
+
+	/* Recent BUFFER FULLs, see can327_rx_overflow() */
+	unsigned long rx_overflow_window;	/* jiffies at first of them */
+	unsigned int rx_overflow_recent;
+
+	/* Responses are off while more frames are waiting in tx_fifo,
+	 * so the ELM327 returns to the prompt right after sending.
+	 */
+	bool tx_burst;
+
+	/* The init script has run, and the ELM327 hasn't been reset since.
+	 * If so, reopening the netdev only sends what has changed.
+	 */
+	bool warm;
+
+	/* What the chip said about itself */
+	unsigned long caps;
+	char chip_id[CAN327_SIZE_CHIP_ID];	/* Reply to ATI */
+	const struct can327_backend *backend;	/* Chosen based on caps */
+
+	struct can327_perf perf;
+	struct dentry *debugfs;
 
 	/* Parser state */
 	bool drop_next_line;
+	bool rx_spaces_off;	/* ELM327 has been sent AT S0 */
 
 	/* Stop the channel on UART side hardware failure, e.g. stray
 	 * characters or neverending lines. This may be caused by bad
@@ -132,36 +665,180 @@ struct can327 {
 
 static inline void can327_uart_side_failure(struct can327 *elm);
 
-static void can327_send(struct can327 *elm, const void *buf, size_t len)
+/* Switch the state machine to state, taking the time spent in the
+ * old one for the performance counters.
+ */
+static void can327_set_state(struct can327 *elm, enum can327_state state)
+{
+	ktime_t now;
+
+	lockdep_assert_held(&elm->lock);
+
+	if (elm->state == state)
+		return;
+
+	trace_can327_state(elm->dev, can327_state_names[elm->state],
+			   can327_state_names[state]);
+
+	now = ktime_get();
+	elm->perf.state_ns[elm->state] +=
+		ktime_to_ns(ktime_sub(now, elm->perf.state_since));
+	elm->perf.state_since = now;
+
+	WRITE_ONCE(elm->state, state);
+}
+
+static void can327_hist_add(u64 *hist, ktime_t latency)
+{
+	s64 us = ktime_to_us(latency);
+	unsigned int i = 0;
+
+	if (us >= CAN327_HIST_MIN_US)
+		i = min_t(unsigned int, ilog2(us / CAN327_HIST_MIN_US) + 1,
+			  CAN327_HIST_BUCKETS - 1);
+
+	hist[i]++;
+}
+
+/* Consumer side view of the RX buffer's head.
+ * The bytes before it, their <CR> marks and timestamps are visible.
+ */
+static inline unsigned int can327_rxhead(const struct can327 *elm)
+{
+	return smp_load_acquire(&elm->rxhead);
+}
+
+/* Number of bytes in the RX buffer that are yet to be parsed */
+static inline unsigned int can327_rxfill(const struct can327 *elm)
 {
-	int written;
+	return can327_rxhead(elm) - elm->rxtail;
+}
+
+static inline u8 can327_rxbuf_at(const struct can327 *elm, unsigned int pos)
+{
+	return elm->rxbuf[pos & (elm->rxbuf_size - 1)];
+}
+
+static void can327_drop_bytes(struct can327 *elm, unsigned int n)
+{
+	lockdep_assert_held(&elm->lock);
+
+	/* Pairs with smp_load_acquire() in can327_rx_room(). */
+	smp_store_release(&elm->rxtail, elm->rxtail + n);
+	if ((int)(elm->rxscan - elm->rxtail) < 0)
+		elm->rxscan = elm->rxtail;
+}
+
+static void can327_drop_all_bytes(struct can327 *elm)
+{
+	can327_drop_bytes(elm, can327_rxfill(elm));
+}
 
+/* Queue data for the TTY, behind anything not written yet.
+ * It is written by can327_tx_flush(), which the caller must call
+ * after releasing elm->lock. This way, the TTY driver isn't called
+ * with the state machine locked.
+ */
+static void can327_send(struct can327 *elm, const void *buf, size_t len)
+{
 	lockdep_assert_held(&elm->lock);
 
 	if (elm->uart_side_failure)
 		return;
 
-	memcpy(elm->txbuf, buf, len);
+	trace_can327_send(elm->dev, buf, len);
 
-	/* Order of next two lines is *very* important.
-	 * When we are sending a little amount of data,
-	 * the transfer may be completed inside the ops->write()
-	 * routine, because it's running with interrupts enabled.
-	 * In this case we *never* got WRITE_WAKEUP event,
-	 * if we did not request it before write operation.
-	 *       14 Oct 1994  Dmitry Gorodchanin.
-	 */
-	set_bit(TTY_DO_WRITE_WAKEUP, &elm->tty->flags);
-	written = elm->tty->ops->write(elm->tty, elm->txbuf, len);
-	if (written < 0) {
-		netdev_err(elm->dev, "Failed to write to tty %s.\n",
+	spin_lock(&elm->tx_lock);
+
+	if (elm->txleft + len > sizeof(elm->txbuf)) {
+		spin_unlock(&elm->tx_lock);
+
+		/* The TTY isn't taking any data. */
+		netdev_err(elm->dev, "TX buffer overflow on tty %s.\n",
 			   elm->tty->name);
 		can327_uart_side_failure(elm);
 		return;
 	}
 
-	elm->txleft = len - written;
-	elm->txhead = elm->txbuf + written;
+	if (elm->txhead + elm->txleft + len > elm->txbuf + sizeof(elm->txbuf)) {
+		memmove(elm->txbuf, elm->txhead, elm->txleft);
+		elm->txhead = elm->txbuf;
+	}
+
+	memcpy(elm->txhead + elm->txleft, buf, len);
+	elm->txleft += len;
+
+	spin_unlock(&elm->tx_lock);
+}
+
+/* Write out as much of the TX buffer as the TTY takes.
+ * Returns the TTY driver's error, if any.
+ */
+static ssize_t can327_tx_write(struct can327 *elm)
+{
+	ssize_t written = 0;
+
+	lockdep_assert_held(&elm->tx_lock);
+
+	if (elm->txleft && !READ_ONCE(elm->uart_side_failure)) {
+		/* Order of next two lines is *very* important.
+		 * When we are sending a little amount of data,
+		 * the transfer may be completed inside the ops->write()
+		 * routine, because it's running with interrupts enabled.
+		 * In this case we *never* got WRITE_WAKEUP event,
+		 * if we did not request it before write operation.
+		 *       14 Oct 1994  Dmitry Gorodchanin.
+		 */
+		set_bit(TTY_DO_WRITE_WAKEUP, &elm->tty->flags);
+
+		/* In combining mode, let data pile up until it can be
+		 * written at once, rather than split across TTY writes.
+		 * If the TTY driver has nothing left in flight, waiting
+		 * won't make more room, so write what it takes.
+		 */
+		if (!tx_combine ||
+		    tty_write_room(elm->tty) >= elm->txleft ||
+		    !tty_chars_in_buffer(elm->tty))
+			written = elm->tty->ops->write(elm->tty, elm->txhead,
+						       elm->txleft);
+		if (written > 0) {
+			elm->txleft -= written;
+			elm->txhead += written;
+
+			elm->perf.tx_bytes += written;
+			elm->perf.tx_busy_ns += written *
+						READ_ONCE(elm->rx_byte_ns);
+		}
+	}
+
+	if (!elm->txleft)
+		clear_bit(TTY_DO_WRITE_WAKEUP, &elm->tty->flags);
+
+	return written;
+}
+
+static void can327_tx_write_failed(struct can327 *elm)
+{
+	spin_lock_bh(&elm->lock);
+	netdev_err(elm->dev, "Failed to write to tty %s.\n",
+		   elm->tty->name);
+	can327_uart_side_failure(elm);
+	spin_unlock_bh(&elm->lock);
+}
+
+/* Write out the TX buffer.
+ * Called after releasing elm->lock, and when the TTY is writable.
+ */
+static void can327_tx_flush(struct can327 *elm)
+{
+	ssize_t written;
+
+	spin_lock_bh(&elm->tx_lock);
+	written = can327_tx_write(elm);
+	spin_unlock_bh(&elm->tx_lock);
+
+	if (written < 0)
+		can327_tx_write_failed(elm);
 }
 
 /* Take the ELM327 out of almost any state and back into command mode.
@@ -176,123 +853,765 @@ static void can327_kick_into_cmd_mode(struct can327 *elm)
 	if (elm->state != CAN327_STATE_GETDUMMYCHAR &&
 	    elm->state != CAN327_STATE_GETPROMPT) {
 		can327_send(elm, CAN327_DUMMY_STRING, 1);
+		elm->perf.kicks++;
 
-		elm->state = CAN327_STATE_GETDUMMYCHAR;
+		can327_set_state(elm, CAN327_STATE_GETDUMMYCHAR);
+
+		/* Any pending echo line will be swallowed while we wait
+		 * for the dummy char, so don't drop the line after it.
+		 */
+		elm->drop_next_line = 0;
 	}
 }
 
-/* Schedule a CAN frame and necessary config changes to be sent to the TTY. */
-static void can327_send_frame(struct can327 *elm, struct can_frame *frame)
+/* Is frame sent with a single STPX, rather than AT SH and data? */
+static bool can327_tx_one_shot(const struct can327 *elm,
+			       const struct can_frame *frame)
+{
+	return elm->backend->one_shot_tx && frame->len &&
+	       !(frame->can_id & CAN_RTR_FLAG);
+}
+
+/* Let the chip answer flow control for replies to frames sent with can_id,
+ * if the flow control table says so.
+ */
+static void can327_select_fc(struct can327 *elm, canid_t can_id)
 {
+	unsigned int i;
+
 	lockdep_assert_held(&elm->lock);
 
-	/* Schedule any necessary changes in ELM327's CAN configuration */
-	if (elm->can_frame_to_send.can_id != frame->can_id) {
-		/* Set the new CAN ID for transmission. */
-		if ((frame->can_id ^ elm->can_frame_to_send.can_id)
-		    & CAN_EFF_FLAG) {
-			elm->can_config =
-				(frame->can_id & CAN_EFF_FLAG ? 0 : CAN327_CAN_CONFIG_SEND_SFF) |
-				CAN327_CAN_CONFIG_VARIABLE_DLC |
-				CAN327_CAN_CONFIG_RECV_BOTH_SFF_EFF |
-				elm->can_bitrate_divisor;
+	can_id &= CAN_EFF_FLAG | CAN_EFF_MASK;
 
-			set_bit(CAN327_TX_DO_CAN_CONFIG, &elm->cmds_todo);
-		}
+	for (i = 0; i < elm->fc_table.count; i++) {
+		if (elm->fc_table.entry[i].tx_id == can_id) {
+			elm->fc = elm->fc_table.entry[i];
+			elm->fc_on = true;
 
-		if (frame->can_id & CAN_EFF_FLAG) {
-			clear_bit(CAN327_TX_DO_CANID_11BIT, &elm->cmds_todo);
-			set_bit(CAN327_TX_DO_CANID_29BIT_LOW, &elm->cmds_todo);
-			set_bit(CAN327_TX_DO_CANID_29BIT_HIGH, &elm->cmds_todo);
-		} else {
-			set_bit(CAN327_TX_DO_CANID_11BIT, &elm->cmds_todo);
-			clear_bit(CAN327_TX_DO_CANID_29BIT_LOW,
-				  &elm->cmds_todo);
-			clear_bit(CAN327_TX_DO_CANID_29BIT_HIGH,
-				  &elm->cmds_todo);
+			/* The shadow state skips what's set up already */
+			set_bit(CAN327_TX_DO_FC_HEADER, &elm->cmds_todo);
+			set_bit(CAN327_TX_DO_FC_DATA, &elm->cmds_todo);
+			set_bit(CAN327_TX_DO_FC_MODE, &elm->cmds_todo);
+			set_bit(CAN327_TX_DO_FC_ENABLE, &elm->cmds_todo);
+			return;
 		}
 	}
 
-	/* Schedule the CAN frame itself. */
-	elm->can_frame_to_send = *frame;
-	set_bit(CAN327_TX_DO_CAN_DATA, &elm->cmds_todo);
+	/* Don't answer replies to other frames with the wrong CAN ID */
+	if (elm->fc_on) {
+		elm->fc_on = false;
+		set_bit(CAN327_TX_DO_FC_ENABLE, &elm->cmds_todo);
+	}
+}
 
-	can327_kick_into_cmd_mode(elm);
+static struct can327_reply_time *can327_find_reply_time(struct can327 *elm,
+							canid_t can_id)
+{
+	unsigned int i;
+
+	for (i = 0; i < CAN327_SIZE_REPLY_TIMES; i++) {
+		struct can327_reply_time *rt = &elm->reply_times[i];
+
+		if (rt->can_id == can_id &&
+		    ewma_can327_reply_read(&rt->latency))
+			return rt;
+	}
+
+	return NULL;
 }
 
-/* ELM327 initialisation sequence.
- * The line length is limited by the buffer in can327_handle_prompt().
+/* Choose the AT ST timeout for waiting for replies to can_id.
+ * This is reply_timeout, or the maximum, unless we have learnt how
+ * long replies to this CAN ID usually take.
  */
-static char *can327_init_script[] = {
-	"AT WS\r",        /* v1.0: Warm Start */
-	"AT PP FF OFF\r", /* v1.0: All Programmable Parameters Off */
-	"AT M0\r",        /* v1.0: Memory Off */
-	"AT AL\r",        /* v1.0: Allow Long messages */
-	"AT BI\r",        /* v1.0: Bypass Initialisation */
-	"AT CAF0\r",      /* v1.0: CAN Auto Formatting Off */
-	"AT CFC0\r",      /* v1.0: CAN Flow Control Off */
-	"AT CF 000\r",    /* v1.0: Reset CAN ID Filter */
-	"AT CM 000\r",    /* v1.0: Reset CAN ID Mask */
-	"AT E1\r",        /* v1.0: Echo On */
-	"AT H1\r",        /* v1.0: Headers On */
-	"AT L0\r",        /* v1.0: Linefeeds Off */
-	"AT SH 7DF\r",    /* v1.0: Set CAN sending ID to 0x7df */
-	"AT ST FF\r",     /* v1.0: Set maximum Timeout for response after TX */
-	"AT AT0\r",       /* v1.2: Adaptive Timing Off */
-	"AT D1\r",        /* v1.3: Print DLC On */
-	"AT S1\r",        /* v1.3: Spaces On */
-	"AT TP B\r",      /* v1.0: Try Protocol B */
-	NULL
-};
-
-static void can327_init_device(struct can327 *elm)
+static void can327_select_reply_timeout(struct can327 *elm, canid_t can_id)
 {
+	unsigned int limit = READ_ONCE(reply_timeout);
+	unsigned int ms;
+	u8 st;
+
 	lockdep_assert_held(&elm->lock);
 
-	elm->state = CAN327_STATE_NOTINIT;
-	elm->can_frame_to_send.can_id = 0x7df; /* ELM327 HW default */
-	elm->rxfill = 0;
-	elm->drop_next_line = 0;
+	if (!limit || limit > CAN327_REPLY_TIMEOUT_MAX_MS)
+		limit = CAN327_REPLY_TIMEOUT_MAX_MS;
+	ms = limit;
 
-	/* We can only set the bitrate as a fraction of 500000.
-	 * The bitrates listed in can327_bitrate_const will
-	 * limit the user to the right values.
-	 */
-	elm->can_bitrate_divisor = 500000 / elm->can.bittiming.bitrate;
-	elm->can_config =
-		CAN327_CAN_CONFIG_SEND_SFF | CAN327_CAN_CONFIG_VARIABLE_DLC |
-		CAN327_CAN_CONFIG_RECV_BOTH_SFF_EFF | elm->can_bitrate_divisor;
+	if (READ_ONCE(reply_timeout_adapt)) {
+		struct can327_reply_time *rt =
+			can327_find_reply_time(elm, can_id &
+					       (CAN_EFF_FLAG | CAN_EFF_MASK));
 
-	/* Configure ELM327 and then start monitoring */
-	elm->next_init_cmd = &can327_init_script[0];
-	set_bit(CAN327_TX_DO_INIT, &elm->cmds_todo);
-	set_bit(CAN327_TX_DO_SILENT_MONITOR, &elm->cmds_todo);
-	set_bit(CAN327_TX_DO_RESPONSES, &elm->cmds_todo);
-	set_bit(CAN327_TX_DO_CAN_CONFIG, &elm->cmds_todo);
+		if (rt)
+			ms = min_t(unsigned int, limit,
+				   2 * ewma_can327_reply_read(&rt->latency) /
+				   USEC_PER_MSEC + CAN327_REPLY_MARGIN_MS);
+	}
 
-	can327_kick_into_cmd_mode(elm);
+	/* AT ST 00 would select the default of 200 ms */
+	st = clamp_val(DIV_ROUND_UP(ms, CAN327_REPLY_TIMEOUT_STEP_MS),
+		       1, 0xff);
+
+	if (st != elm->reply_timeout ||
+	    !test_bit(CAN327_TX_DO_REPLY_TIMEOUT, &elm->shadow_known)) {
+		elm->reply_timeout = st;
+		set_bit(CAN327_TX_DO_REPLY_TIMEOUT, &elm->cmds_todo);
+	}
 }
 
-static void can327_feed_frame_to_netdev(struct can327 *elm,
-					struct sk_buff *skb)
+/* Could a frame with can_id be a reply to the one we sent?
+ * On a busy bus, the next frame to arrive is most likely unrelated.
+ * So unless the hardware filters only let through what we're
+ * interested in, we only learn from OBD-II and ISO 15765-4 requests,
+ * whose replies we can tell by their CAN IDs.
+ */
+static bool can327_is_reply(const struct can327 *elm, canid_t can_id)
 {
+	canid_t req = elm->reply_wait_id;
+
 	lockdep_assert_held(&elm->lock);
 
-	if (!netif_running(elm->dev))
-		return;
+	if (elm->hw_filters.count)
+		return true;
 
-	/* Queue for NAPI pickup.
-	 * rx-offload will update stats and LEDs for us.
-	 */
-	if (can_rx_offload_queue_tail(&elm->offload, skb))
-		elm->dev->stats.rx_fifo_errors++;
+	can_id &= CAN_EFF_FLAG | CAN_EFF_MASK;
+	if ((can_id ^ req) & CAN_EFF_FLAG)
+		return false;
 
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,15,0)
+	if (!(req & CAN_EFF_FLAG)) {
+		/* 7DF asks all ECUs, 7E0..7E7 a single one.
+		 * ECUs reply with their own CAN ID plus 8.
+		 */
+		if (req == 0x7df)
+			return can_id >= 0x7e8 && can_id <= 0x7ef;
+		if (req >= 0x7e0 && req <= 0x7e7)
+			return can_id == req + 8;
+
+		return false;
+	}
+
+	/* 18 DB 33 F1 asks all ECUs, 18 DA tt ss a single one.
+	 * Replies swap the target and source addresses.
+	 */
+	req &= CAN_EFF_MASK;
+	can_id &= CAN_EFF_MASK;
+	if (req == 0x18db33f1)
+		return (can_id & 0x1fffff00) == 0x18daf100;
+	if ((req & 0x1fff0000) == 0x18da0000)
+		return can_id == (0x18da0000 | (req & 0xff) << 8 |
+				  (req >> 8 & 0xff));
+
+	return false;
+}
+
+/* The first reply to the frame we sent has arrived. Learn from it. */
+static void can327_reply_seen(struct can327 *elm)
+{
+	struct can327_reply_time *rt;
+	s64 us;
+
+	lockdep_assert_held(&elm->lock);
+
+	elm->reply_wait = false;
+
+	/* No echo, no RX timestamps? Then we can't tell. */
+	if (!elm->reply_wait_stamp || !elm->rxline_stamp)
+		return;
+
+	us = ktime_us_delta(elm->rxline_stamp, elm->reply_wait_stamp);
+	if (us < 0)
+		return;
+
+	rt = can327_find_reply_time(elm, elm->reply_wait_id);
+	if (!rt) {
+		rt = &elm->reply_times[elm->next_reply_time];
+		elm->next_reply_time = (elm->next_reply_time + 1) %
+				       CAN327_SIZE_REPLY_TIMES;
+
+		rt->can_id = elm->reply_wait_id;
+		ewma_can327_reply_init(&rt->latency);
+	}
+
+	/* A zero average means no samples, so count at least 1 us */
+	ewma_can327_reply_add(&rt->latency,
+			      clamp_val(us, 1, CAN327_REPLY_TIMEOUT_MAX_MS *
+					USEC_PER_MSEC));
+}
+
+/* The reply timeout ran out without any reply.
+ * Maybe we cut it too short, so wait the maximum time next time,
+ * and learn afresh.
+ */
+static void can327_reply_missed(struct can327 *elm)
+{
+	struct can327_reply_time *rt;
+
+	lockdep_assert_held(&elm->lock);
+
+	elm->reply_wait = false;
+
+	rt = can327_find_reply_time(elm, elm->reply_wait_id);
+	if (rt)
+		ewma_can327_reply_init(&rt->latency);
+}
+
+/* What a frame costs to send, for BQL: Its bytes on the UART */
+static unsigned int can327_tx_cost(const struct can_frame *frame)
+{
+	if (frame->can_id & CAN_RTR_FLAG)
+		return sizeof("ATRTR\r") - 1;
+
+	return 2 * frame->len + 1;
+}
+
+/* The ELM327 has taken can_frame_to_send. Hand its echo skb to the
+ * stack, tell BQL, and account for how long it took since start_xmit.
+ *
+ * This is called when its echo line arrives, or at the next prompt if
+ * there was none, as with TX burst mode or when listening was
+ * interrupted.
+ */
+static void can327_tx_complete(struct can327 *elm)
+{
+	struct can_frame *frame = &elm->can_frame_to_send;
+	struct net_device *dev = elm->dev;
+
+	lockdep_assert_held(&elm->lock);
+
+	if (!elm->tx_echo_pending || !elm->tx_echo_sent)
+		return;
+
+	elm->tx_echo_pending = false;
+
+	can327_hist_add(elm->perf.tx_latency,
+			ktime_sub(ktime_get(), elm->tx_queued));
+
+	dev->stats.tx_packets++;
+	dev->stats.tx_bytes += frame->can_id & CAN_RTR_FLAG ? 0 : frame->len;
+
+	/* Pairs with test_and_set_bit_lock() in start_xmit */
+	can327_get_echo_skb(dev, elm->tx_echo);
+	clear_bit_unlock(elm->tx_echo, &elm->echo_used);
+
+	netdev_completed_queue(dev, 1, can327_tx_cost(frame));
+}
+
+/* Schedule a CAN frame and necessary config changes to be sent to the TTY.
+ * This is called from can327_handle_prompt(), so we're in command mode.
+ */
+static void can327_send_frame(struct can327 *elm, struct can_frame *frame)
+{
+	lockdep_assert_held(&elm->lock);
+
+	/* Schedule any necessary changes in ELM327's CAN configuration */
+	if (elm->can_frame_to_send.can_id != frame->can_id) {
+		/* Switch between SFF and EFF */
+		if ((frame->can_id ^ elm->can_frame_to_send.can_id)
+		    & CAN_EFF_FLAG) {
+			elm->can_config =
+				(frame->can_id & CAN_EFF_FLAG ? 0 : CAN327_CAN_CONFIG_SEND_SFF) |
+				CAN327_CAN_CONFIG_VARIABLE_DLC |
+				CAN327_CAN_CONFIG_RECV_BOTH_SFF_EFF |
+				elm->can_bitrate_divisor;
+
+			set_bit(CAN327_TX_DO_CAN_CONFIG, &elm->cmds_todo);
+		}
+	}
+
+	if (can327_tx_one_shot(elm, frame)) {
+		/* STPX brings its own header, AT SH stays as it is. */
+		clear_bit(CAN327_TX_DO_CANID_11BIT, &elm->cmds_todo);
+		clear_bit(CAN327_TX_DO_CANID_29BIT_LOW, &elm->cmds_todo);
+		clear_bit(CAN327_TX_DO_CANID_29BIT_HIGH, &elm->cmds_todo);
+	} else if (elm->can_frame_to_send.can_id != frame->can_id ||
+		   elm->backend->one_shot_tx) {
+		/* Set the new CAN ID for transmission.
+		 * After STPX, the AT SH header may differ from the last
+		 * frame's, so let the shadow state sort it out.
+		 */
+		if (frame->can_id & CAN_EFF_FLAG) {
+			clear_bit(CAN327_TX_DO_CANID_11BIT, &elm->cmds_todo);
+			set_bit(CAN327_TX_DO_CANID_29BIT_LOW, &elm->cmds_todo);
+			set_bit(CAN327_TX_DO_CANID_29BIT_HIGH, &elm->cmds_todo);
+		} else {
+			set_bit(CAN327_TX_DO_CANID_11BIT, &elm->cmds_todo);
+			clear_bit(CAN327_TX_DO_CANID_29BIT_LOW,
+				  &elm->cmds_todo);
+			clear_bit(CAN327_TX_DO_CANID_29BIT_HIGH,
+				  &elm->cmds_todo);
+		}
+	}
+
+	can327_select_fc(elm, frame->can_id);
+
+	/* Schedule the CAN frame itself. */
+	elm->can_frame_to_send = *frame;
+	set_bit(CAN327_TX_DO_CAN_DATA, &elm->cmds_todo);
+}
+
+/* The part of the CAN ID that the ELM327 needs to be reconfigured for */
+static inline canid_t can327_tx_header(const struct can_frame *frame)
+{
+	return frame->can_id & (CAN_EFF_FLAG | CAN_EFF_MASK);
+}
+
+static bool can327_tx_pending(struct can327 *elm)
+{
+	lockdep_assert_held(&elm->lock);
+
+	return elm->tx_sched_len || !kfifo_is_empty(&elm->tx_fifo);
+}
+
+/* With CAN327_TX_SCHED_GROUP, we prefer frames that can be sent without
+ * reconfiguring the ELM327: First the same CAN ID as the last frame,
+ * then at least the same SFF/EFF mode. The oldest matching frame is
+ * picked, so frames with the same CAN ID stay in order.
+ */
+static unsigned int can327_tx_pick_group(struct can327 *elm)
+{
+	canid_t last = can327_tx_header(&elm->can_frame_to_send);
+	canid_t oldest = can327_tx_header(&elm->tx_sched[0].frame);
+	bool oldest_needs_config = (oldest ^ last) & CAN_EFF_FLAG;
+	unsigned int pick = 0;
+	unsigned int i;
+
+	if (oldest == last)
+		return 0;
+
+	for (i = 1; i < elm->tx_sched_len; i++) {
+		canid_t header = can327_tx_header(&elm->tx_sched[i].frame);
+
+		if (header == last) {
+			pick = i;
+			break;
+		}
+
+		if (!pick && oldest_needs_config &&
+		    !((header ^ last) & CAN_EFF_FLAG))
+			pick = i;
+	}
+
+	if (pick) {
+		canid_t header = can327_tx_header(&elm->tx_sched[pick].frame);
+
+		if (header == last)
+			elm->tx_canid_switches_saved++;
+		if (oldest_needs_config)
+			elm->tx_config_switches_saved++;
+	}
+
+	return pick;
+}
+
+/* Order as in CAN arbitration, lowest first: The 11 bit base ID,
+ * then SFF's RTR bit against EFF's recessive SRR bit, the IDE bit,
+ * and EFF's 18 bit ID extension and RTR bit.
+ */
+static u32 can327_tx_arbitration_key(canid_t can_id)
+{
+	u32 rtr = !!(can_id & CAN_RTR_FLAG);
+	u32 id;
+
+	if (!(can_id & CAN_EFF_FLAG))
+		return (can_id & CAN_SFF_MASK) << 21 | rtr << 20;
+
+	id = can_id & CAN_EFF_MASK;
+	return (id >> 18) << 21 | 3 << 19 | (id & 0x3ffff) << 1 | rtr;
+}
+
+/* With CAN327_TX_SCHED_PRIO, the frame that would win arbitration
+ * goes first, like from a controller's TX mailboxes. The oldest of
+ * them is picked, so frames with the same CAN ID stay in order.
+ */
+static unsigned int can327_tx_pick_prio(struct can327 *elm)
+{
+	unsigned int pick = 0;
+	u32 best = can327_tx_arbitration_key(elm->tx_sched[0].frame.can_id);
+	unsigned int i;
+
+	for (i = 1; i < elm->tx_sched_len; i++) {
+		canid_t can_id = elm->tx_sched[i].frame.can_id;
+		u32 key = can327_tx_arbitration_key(can_id);
+
+		if (key < best) {
+			best = key;
+			pick = i;
+		}
+	}
+
+	return pick;
+}
+
+/* With CAN327_TX_SCHED_DEADLINE, the earliest deadline goes first.
+ * Frames with the same CAN ID have the same deadline after being
+ * queued, so they stay in order.
+ */
+static unsigned int can327_tx_pick_deadline(struct can327 *elm)
+{
+	unsigned int pick = 0;
+	unsigned int i;
+
+	for (i = 1; i < elm->tx_sched_len; i++) {
+		if (ktime_before(elm->tx_sched[i].deadline,
+				 elm->tx_sched[pick].deadline))
+			pick = i;
+	}
+
+	return pick;
+}
+
+/* Look up a frame's deadline, as it moves to tx_sched */
+static void can327_tx_set_deadline(struct can327 *elm,
+				   struct can327_tx_frame *entry)
+{
+	const struct can327_tx_deadline_list *list = &elm->tx_deadlines;
+	canid_t can_id = entry->frame.can_id & (CAN_EFF_FLAG | CAN_EFF_MASK);
+	u32 us = list->default_us ? : CAN327_TX_DEADLINE_DEFAULT_US;
+	unsigned int i;
+
+	lockdep_assert_held(&elm->lock);
+
+	for (i = 0; i < list->count; i++) {
+		const struct can327_tx_deadline *d = &list->entry[i];
+
+		if (!((can_id ^ d->can_id) & (CAN_EFF_FLAG | d->can_mask))) {
+			us = d->deadline_us;
+			break;
+		}
+	}
+
+	entry->deadline = ktime_add_us(entry->queued, us);
+}
+
+/* Pick the next CAN frame to send, according to the tx_sched policy.
+ *
+ * To keep the others from starving a frame, the oldest queued frame
+ * is sent once it has been passed over CAN327_TXSCHED_MAX_SKIPS times.
+ */
+static bool can327_tx_dequeue(struct can327 *elm,
+			      struct can327_tx_frame *entry)
+{
+	unsigned int pick = 0;
+
+	lockdep_assert_held(&elm->lock);
+
+	while (elm->tx_sched_len < CAN327_SIZE_TXSCHED &&
+	       kfifo_get(&elm->tx_fifo, &elm->tx_sched[elm->tx_sched_len])) {
+		can327_tx_set_deadline(elm, &elm->tx_sched[elm->tx_sched_len]);
+		elm->tx_sched_len++;
+	}
+
+	if (!elm->tx_sched_len)
+		return false;
+
+	if (elm->tx_sched_skips < CAN327_TXSCHED_MAX_SKIPS) {
+		switch (READ_ONCE(tx_sched)) {
+		case CAN327_TX_SCHED_GROUP:
+			pick = can327_tx_pick_group(elm);
+			break;
+		case CAN327_TX_SCHED_PRIO:
+			pick = can327_tx_pick_prio(elm);
+			break;
+		case CAN327_TX_SCHED_DEADLINE:
+			pick = can327_tx_pick_deadline(elm);
+			break;
+		}
+	}
+
+	*entry = elm->tx_sched[pick];
+
+	if (pick)
+		elm->tx_sched_skips++;
+	else
+		elm->tx_sched_skips = 0;
+
+	if (ktime_after(ktime_get(), entry->deadline))
+		elm->tx_deadlines_missed++;
+
+	elm->tx_sched_len--;
+	memmove(&elm->tx_sched[pick], &elm->tx_sched[pick + 1],
+		(elm->tx_sched_len - pick) * sizeof(elm->tx_sched[0]));
+
+	return true;
+}
+
+/* Switch TX burst mode on or off.
+ * While bursting, we don't wait for replies after sending a frame, and
+ * instead send the next one straight from the following prompt.
+ */
+static void can327_set_tx_burst(struct can327 *elm, bool burst)
+{
+	lockdep_assert_held(&elm->lock);
+
+	if (elm->tx_burst == burst)
+		return;
+
+	elm->tx_burst = burst;
+
+	/* Responses are always off in listen-only mode. */
+	if (!(elm->can.ctrlmode & CAN_CTRLMODE_LISTENONLY))
+		set_bit(CAN327_TX_DO_RESPONSES, &elm->cmds_todo);
+}
+
+/* ELM327 initialisation sequence.
+ * The line length is limited by the buffer in can327_handle_prompt().
+ */
+static char *can327_init_script[] = {
+	"AT WS\r",        /* v1.0: Warm Start */
+	"AT PP FF OFF\r", /* v1.0: All Programmable Parameters Off */
+	"AT M0\r",        /* v1.0: Memory Off */
+	"AT AL\r",        /* v1.0: Allow Long messages */
+	"AT BI\r",        /* v1.0: Bypass Initialisation */
+	"AT CAF0\r",      /* v1.0: CAN Auto Formatting Off */
+	"AT CFC0\r",      /* v1.0: CAN Flow Control Off */
+	"AT CF 000\r",    /* v1.0: Reset CAN ID Filter */
+	"AT CM 000\r",    /* v1.0: Reset CAN ID Mask */
+	"AT E1\r",        /* v1.0: Echo On */
+	"AT H1\r",        /* v1.0: Headers On */
+	"AT L0\r",        /* v1.0: Linefeeds Off */
+	"AT SH 7DF\r",    /* v1.0: Set CAN sending ID to 0x7df */
+	"AT ST FF\r",     /* v1.0: Set maximum Timeout for response after TX */
+	"AT AT0\r",       /* v1.2: Adaptive Timing Off */
+	"AT D1\r",        /* v1.3: Print DLC On */
+	"AT S1\r",        /* v1.3: Spaces On */
+	"AT TP B\r",      /* v1.0: Try Protocol B */
+	NULL
+};
+
+/* Run the init script, which resets the ELM327 with AT WS. */
+static void can327_start_init_script(struct can327 *elm)
+{
+	lockdep_assert_held(&elm->lock);
+
+	elm->next_init_cmd = &can327_init_script[0];
+	set_bit(CAN327_TX_DO_INIT, &elm->cmds_todo);
+
+	/* We don't know the ELM327's defaults */
+	elm->shadow_known = 0;
+	elm->rx_spaces_off = false;
+
+	/* Find out what we're talking to, once the script has run.
+	 * The chip may have been swapped since we last asked.
+	 */
+	elm->caps = 0;
+	elm->chip_id[0] = '\0';
+	elm->backend = &can327_backend_elm;
+	if (READ_ONCE(probe_caps))
+		elm->cmds_todo |= CAN327_TX_DO_PROBE_MASK;
+}
+
+/* The ELM327 can do 4000000 / hh baud. Find the closest one. */
+static u8 can327_brd_divisor(unsigned int baud)
+{
+	return clamp_val(DIV_ROUND_CLOSEST(4000000, baud), 8, 0xff);
+}
+
+/* The ELM327's baud rate. Once AT BRD has switched it, this is the
+ * exact rate, which the TTY may only approximate with the closest
+ * standard one. Before that, all we know is the TTY's rate.
+ */
+static unsigned int can327_uart_baud(struct can327 *elm)
+{
+	return elm->baud_now ?: tty_get_baud_rate(elm->tty);
+}
+
+static void can327_init_device(struct can327 *elm)
+{
+	lockdep_assert_held(&elm->lock);
+
+	can327_set_state(elm, CAN327_STATE_NOTINIT);
+	elm->can_frame_to_send.can_id = 0x7df; /* ELM327 HW default */
+	can327_drop_all_bytes(elm);
+	elm->drop_next_line = 0;
+	elm->tx_burst = false;
+
+	/* We can only set the bitrate as a fraction of 500000.
+	 * The bitrates listed in can327_bitrate_const will
+	 * limit the user to the right values.
+	 */
+	elm->can_bitrate_divisor = 500000 / elm->can.bittiming.bitrate;
+	elm->can_config =
+		CAN327_CAN_CONFIG_SEND_SFF | CAN327_CAN_CONFIG_VARIABLE_DLC |
+		CAN327_CAN_CONFIG_RECV_BOTH_SFF_EFF | elm->can_bitrate_divisor;
+
+	/* If the ELM327 has been initialised before, check whether it
+	 * still is. If so, only the settings below that differ from
+	 * the shadow state will be sent.
+	 * Otherwise, or if the check fails, run the init script first.
+	 */
+	if (elm->warm)
+		set_bit(CAN327_TX_DO_WARM_CHECK, &elm->cmds_todo);
+	else
+		can327_start_init_script(elm);
+
+	/* Configure ELM327 and then start monitoring */
+	set_bit(CAN327_TX_DO_SILENT_MONITOR, &elm->cmds_todo);
+	set_bit(CAN327_TX_DO_RESPONSES, &elm->cmds_todo);
+	set_bit(CAN327_TX_DO_CAN_CONFIG, &elm->cmds_todo);
+
+	/* No flow control until a frame in the table is sent */
+	elm->fc_on = false;
+	set_bit(CAN327_TX_DO_FC_ENABLE, &elm->cmds_todo);
+
+	/* Make sure the header matches can_frame_to_send.
+	 * The init script sets it, but the last session may have changed it.
+	 */
+	set_bit(CAN327_TX_DO_CANID_11BIT, &elm->cmds_todo);
+
+	/* The init script resets the hardware filter.
+	 * If it doesn't run, the last session may have set another one.
+	 */
+	set_bit(CAN327_TX_DO_CAN_FILTER, &elm->cmds_todo);
+
+	/* The init script turns spaces on, so we can tell SFF and EFF
+	 * apart even on older chips. Turn them off if asked to.
+	 */
+	set_bit(CAN327_TX_DO_SPACES, &elm->cmds_todo);
+
+	/* AT WS keeps the baud rate, so we only need to switch once. */
+	elm->baud_want = READ_ONCE(uart_baudrate);
+	if (elm->baud_want && !elm->baud_failed &&
+	    4000000 / can327_brd_divisor(elm->baud_want) !=
+	    can327_uart_baud(elm))
+		set_bit(CAN327_TX_DO_BAUDRATE, &elm->cmds_todo);
+
+	can327_kick_into_cmd_mode(elm);
+}
+
+static void can327_update_byte_time(struct can327 *elm)
+{
+	unsigned int baud = tty_get_baud_rate(elm->tty);
+
+	/* 8N1 means 10 bits per byte. */
+	WRITE_ONCE(elm->rx_byte_ns, baud ? 10 * NSEC_PER_SEC / baud : 0);
+}
+
+static void can327_feed_frame_to_netdev(struct can327 *elm,
+					struct sk_buff *skb)
+{
+	ktime_t stamp = elm->rxline_stamp;
+	int err;
+
+	lockdep_assert_held(&elm->lock);
+
+	if (!netif_running(elm->dev))
+		return;
+
+	/* Frames not from a received line, e.g. bus-off after a UART
+	 * failure, are stamped now.
+	 */
+	if (!stamp)
+		stamp = ktime_get_real();
+	else
+		can327_hist_add(elm->perf.rx_latency,
+				ktime_sub(ktime_get_real(), stamp));
+
+	skb_hwtstamps(skb)->hwtstamp = stamp;
+
+	/* Queue for NAPI pickup, sorted by time of reception.
+	 * rx-offload will update stats and LEDs for us.
+	 */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,15,0)
+	err = can_rx_offload_queue_timestamp(&elm->offload, skb,
+					     (u32)ktime_to_us(stamp));
+#else
+	err = can_rx_offload_queue_sorted(&elm->offload, skb,
+					  (u32)ktime_to_us(stamp));
+#endif
+	if (err)
+		elm->dev->stats.rx_fifo_errors++;
+	else
+		elm->rx_batch++;
+}
+
+/* Hand all frames queued since the last call to NAPI at once.
+ * Called after each pass over the RX buffer, and after queueing
+ * frames outside of the RX path.
+ */
+static void can327_flush_rx_batch(struct can327 *elm)
+{
+	lockdep_assert_held(&elm->lock);
+
+	if (!elm->rx_batch)
+		return;
+
+	/* Remember the typical chunk size for the NAPI weight,
+	 * see can327_rx_weight().
+	 */
+	ewma_can327_batch_add(&elm->rx_batch_avg, elm->rx_batch);
+	elm->rx_batch = 0;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,15,0)
 	/* Wake NAPI */
 	can_rx_offload_irq_finish(&elm->offload);
 #endif
 }
 
+/* Get a CAN skb from the pool, so the RX path doesn't need to
+ * allocate memory while holding elm->lock. If the pool has run dry,
+ * try allocating one anyway.
+ */
+static struct sk_buff *can327_alloc_skb(struct can327 *elm,
+					struct can_frame **cf)
+{
+	struct sk_buff *skb;
+
+	lockdep_assert_held(&elm->lock);
+
+	skb = skb_dequeue(&elm->rx_pool);
+
+	if (skb_queue_len(&elm->rx_pool) < CAN327_SIZE_RXPOOL / 2)
+		schedule_work(&elm->rx_pool_work);
+
+	if (!skb)
+		return alloc_can_skb(elm->dev, cf);
+
+	*cf = (struct can_frame *)skb->data;
+	return skb;
+}
+
+static struct sk_buff *can327_alloc_err_skb(struct can327 *elm,
+					    struct can_frame **cf)
+{
+	struct sk_buff *skb = can327_alloc_skb(elm, cf);
+
+	if (skb) {
+		(*cf)->can_id = CAN_ERR_FLAG;
+		(*cf)->len = CAN_ERR_DLC;
+	}
+
+	return skb;
+}
+
+/* Return an unused skb from can327_alloc_skb() to the pool. */
+static void can327_free_skb(struct can327 *elm, struct sk_buff *skb)
+{
+	lockdep_assert_held(&elm->lock);
+
+	if (skb_queue_len(&elm->rx_pool) >= CAN327_SIZE_RXPOOL) {
+		kfree_skb(skb);
+		return;
+	}
+
+	memset(skb->data, 0, sizeof(struct can_frame));
+	skb_queue_head(&elm->rx_pool, skb);
+}
+
+static void can327_rx_pool_worker(struct work_struct *work)
+{
+	struct can327 *elm = container_of(work, struct can327, rx_pool_work);
+	struct can_frame *cf;
+	struct sk_buff *skb;
+
+	while (skb_queue_len(&elm->rx_pool) < CAN327_SIZE_RXPOOL) {
+		skb = alloc_can_skb(elm->dev, &cf);
+		if (!skb)
+			/* We'll try again once the pool runs low. */
+			break;
+
+		skb_queue_tail(&elm->rx_pool, skb);
+	}
+}
+
 /* Called when we're out of ideas and just want it all to end. */
 static inline void can327_uart_side_failure(struct can327 *elm)
 {
@@ -301,7 +1620,11 @@ static inline void can327_uart_side_failure(struct can327 *elm)
 
 	lockdep_assert_held(&elm->lock);
 
+	trace_can327_uart_side_failure(elm->dev,
+				       can327_state_names[elm->state]);
+
 	elm->uart_side_failure = true;
+	elm->warm = false;
 
 	clear_bit(TTY_DO_WRITE_WAKEUP, &elm->tty->flags);
 
@@ -313,12 +1636,13 @@ static inline void can327_uart_side_failure(struct can327 *elm)
 	netdev_err(elm->dev,
 		   "ELM327 misbehaved. Blocking further communication.\n");
 
-	skb = alloc_can_err_skb(elm->dev, &frame);
+	skb = can327_alloc_err_skb(elm, &frame);
 	if (!skb)
 		return;
 
 	frame->can_id |= CAN_ERR_BUSOFF;
 	can327_feed_frame_to_netdev(elm, skb);
+	can327_flush_rx_batch(elm);
 }
 
 /* Compares a byte buffer (non-NUL terminated) to the payload part of
@@ -339,56 +1663,257 @@ static inline bool can327_rxbuf_cmp(const u8 *buf, size_t nbytes,
 	return (nbytes == ref_len) && !memcmp(buf, reference, ref_len);
 }
 
-static void can327_parse_error(struct can327 *elm, size_t len)
+/* Does the line end in BUFFER FULL, after something it cut short? */
+static bool can327_is_cut_by_buffer_full(const u8 *line, size_t len)
+{
+	const char *full = can327_errs[CAN327_ERR_BUFFER_FULL].msg;
+	size_t full_len = strlen(full);
+
+	return len > full_len &&
+	       !memcmp(&line[len - full_len], full, full_len);
+}
+
+/* Emit the error frame collected by can327_rx_error(), if any. */
+static void can327_emit_error(struct can327 *elm)
 {
 	struct can_frame *frame;
 	struct sk_buff *skb;
 
 	lockdep_assert_held(&elm->lock);
 
-	skb = alloc_can_err_skb(elm->dev, &frame);
+	if (!elm->err_pending)
+		return;
+
+	skb = can327_alloc_err_skb(elm, &frame);
 	if (!skb)
-		/* It's okay to return here:
-		 * The outer parsing loop will drop this UART buffer.
-		 */
+		/* Keep the events, and try again with the next one. */
+		return;
+
+	frame->can_id |= elm->err_frame.can_id;
+	memcpy(frame->data, elm->err_frame.data, CAN_ERR_DLC);
+
+	elm->errors_coalesced += elm->err_pending - 1;
+	elm->err_pending = 0;
+	memset(&elm->err_frame, 0, sizeof(elm->err_frame));
+	elm->err_next = jiffies + msecs_to_jiffies(CAN327_ERR_INTERVAL_MS);
+
+	can327_feed_frame_to_netdev(elm, skb);
+}
+
+static void can327_err_worker(struct work_struct *work)
+{
+	struct can327 *elm = container_of(to_delayed_work(work),
+					  struct can327, err_work);
+
+	spin_lock_bh(&elm->lock);
+	if (netif_running(elm->dev)) {
+		can327_emit_error(elm);
+		can327_flush_rx_batch(elm);
+	}
+	spin_unlock_bh(&elm->lock);
+}
+
+/* Count an error event, and report it in a CAN error frame.
+ * During error storms, there's at most one frame per
+ * CAN327_ERR_INTERVAL_MS, carrying all events since the last one.
+ */
+static void can327_rx_error(struct can327 *elm, enum can327_err kind)
+{
+	lockdep_assert_held(&elm->lock);
+
+	elm->errors[kind]++;
+
+	elm->err_pending++;
+	elm->err_frame.can_id |= can327_errs[kind].class;
+	elm->err_frame.data[1] |= can327_errs[kind].crtl;
+	elm->err_frame.data[2] |= can327_errs[kind].prot;
+
+	if (time_before(jiffies, elm->err_next)) {
+		/* Does nothing if the worker is scheduled already */
+		schedule_delayed_work(&elm->err_work,
+				      elm->err_next - jiffies);
 		return;
+	}
+
+	can327_emit_error(elm);
+}
+
+/* Tell what kind of error message the ELM327 has sent. */
+static enum can327_err can327_parse_error(struct can327 *elm, const u8 *line,
+					  size_t len)
+{
+	enum can327_err kind;
+
+	lockdep_assert_held(&elm->lock);
+
+	/* ERR is followed by two digits, hence line length 5 */
+	if (len == 5 && !memcmp(line, "ERR", 3)) {
+		if (net_ratelimit())
+			netdev_err(elm->dev, "ELM327 reported an ERR%c%c. Please power it off and on again.\n",
+				   line[3], line[4]);
+		elm->warm = false;
+		return CAN327_ERR_ERRXX;
+	}
 
-	/* Filter possible error messages based on length of RX'd line */
-	if (can327_rxbuf_cmp(elm->rxbuf, len, "UNABLE TO CONNECT")) {
-		netdev_err(elm->dev,
-			   "ELM327 reported UNABLE TO CONNECT. Please check your setup.\n");
-	} else if (can327_rxbuf_cmp(elm->rxbuf, len, "BUFFER FULL")) {
-		/* This will only happen if the last data line was complete.
-		 * Otherwise, can327_parse_frame() will heuristically
-		 * emit this kind of error frame instead.
+	for (kind = 0; kind < CAN327_NUM_ERRS; kind++) {
+		if (can327_errs[kind].msg &&
+		    can327_rxbuf_cmp(line, len, can327_errs[kind].msg))
+			break;
+	}
+
+	switch (kind) {
+	case CAN327_ERR_UNABLE_TO_CONNECT:
+		if (net_ratelimit())
+			netdev_err(elm->dev,
+				   "ELM327 reported UNABLE TO CONNECT. Please check your setup.\n");
+		break;
+
+	case CAN327_ERR_LV_RESET:
+		/* Low voltage reset. Our configuration is gone. */
+		if (net_ratelimit())
+			netdev_err(elm->dev,
+				   "ELM327 reported a low voltage reset.\n");
+		elm->warm = false;
+		break;
+
+	case CAN327_NUM_ERRS:
+		/* BUFFER FULL may cut a frame short before its header is
+		 * complete, so can327_parse_frame() can't tell.
 		 */
-		frame->can_id |= CAN_ERR_CRTL;
-		frame->data[1] = CAN_ERR_CRTL_RX_OVERFLOW;
-	} else if (can327_rxbuf_cmp(elm->rxbuf, len, "BUS ERROR")) {
-		frame->can_id |= CAN_ERR_BUSERROR;
-	} else if (can327_rxbuf_cmp(elm->rxbuf, len, "CAN ERROR")) {
-		frame->can_id |= CAN_ERR_PROT;
-	} else if (can327_rxbuf_cmp(elm->rxbuf, len, "<RX ERROR")) {
-		frame->can_id |= CAN_ERR_PROT;
-	} else if (can327_rxbuf_cmp(elm->rxbuf, len, "BUS BUSY")) {
-		frame->can_id |= CAN_ERR_PROT;
-		frame->data[2] = CAN_ERR_PROT_OVERLOAD;
-	} else if (can327_rxbuf_cmp(elm->rxbuf, len, "FB ERROR")) {
-		frame->can_id |= CAN_ERR_PROT;
-		frame->data[2] = CAN_ERR_PROT_TX;
-	} else if (len == 5 && !memcmp(elm->rxbuf, "ERR", 3)) {
-		/* ERR is followed by two digits, hence line length 5 */
-		netdev_err(elm->dev, "ELM327 reported an ERR%c%c. Please power it off and on again.\n",
-			   elm->rxbuf[3], elm->rxbuf[4]);
-		frame->can_id |= CAN_ERR_CRTL;
-	} else {
+		if (can327_is_cut_by_buffer_full(line, len)) {
+			kind = CAN327_ERR_BUFFER_FULL;
+			break;
+		}
+
 		/* Something else has happened.
 		 * Maybe garbage on the UART line.
-		 * Emit a generic error frame.
 		 */
+		kind = CAN327_ERR_GARBLED;
+		break;
+
+	default:
+		break;
 	}
 
-	can327_feed_frame_to_netdev(elm, skb);
+	return kind;
+}
+
+/* Without spaces (AT S0), the line length tells SFF and EFF apart:
+ *
+ * 29-bit ID (EFF):  12345678DPLPLPLPLPLPLPLPL
+ * 11-bit ID (!EFF): 123DPLPLPLPLPLPLPLPL
+ *
+ * SFF lines have an even number of hex digits, EFF lines an odd one.
+ * A truncated line may look like a complete frame of the other kind,
+ * so we only accept lines that end right after the payload or RTR.
+ *
+ * Returns the offset of the payload, -EOVERFLOW for a frame cut short
+ * by BUFFER FULL, or -ENODATA if this doesn't look like a data line at
+ * all, or is garbled.
+ */
+static int can327_nospaces_datastart(const u8 *line, size_t len,
+				     canid_t *can_id)
+{
+	size_t hexrun;
+	size_t tail;
+	bool rtr;
+	int dlc;
+
+	for (hexrun = 0; hexrun < len; hexrun++) {
+		if (!(can327_char_class[line[hexrun]] & CAN327_CC_HEX))
+			break;
+	}
+
+	/* The shortest data line is an SFF frame without payload. */
+	if (hexrun < 4)
+		return -ENODATA;
+
+	tail = hexrun;
+	if (tail < len && line[tail] == ' ')
+		tail++;
+	rtr = (len - tail == 3 && !memcmp(&line[tail], "RTR", 3));
+
+	/* Anything else after the hex dump is either BUFFER FULL cutting
+	 * the line short, or garbage. Leave telling garbage from other
+	 * messages to can327_parse_error(), just like for garbled lines
+	 * with spaces. The first letters of BUFFER FULL may have been
+	 * taken for hex digits, so look at the end of the line.
+	 */
+	if (hexrun != len && !rtr)
+		return can327_is_cut_by_buffer_full(line, len) ?
+		       -EOVERFLOW : -ENODATA;
+
+	if (!(hexrun & 1)) {
+		dlc = can327_char_class[line[3]] & CAN327_CC_NIBBLE;
+		if (dlc <= CAN_MAX_DLEN && hexrun == (rtr ? 4 : 4 + 2 * dlc))
+			return 4;
+	} else if (hexrun >= 9) {
+		dlc = can327_char_class[line[8]] & CAN327_CC_NIBBLE;
+		if (dlc <= CAN_MAX_DLEN && hexrun == (rtr ? 9 : 9 + 2 * dlc)) {
+			*can_id = CAN_EFF_FLAG;
+			return 9;
+		}
+	}
+
+	/* All hex, but not the length of a frame. Without BUFFER FULL,
+	 * the ELM327 didn't cut it short, so bytes got lost on the UART.
+	 */
+	return -ENODATA;
+}
+
+/* Called when a hex dump is shorter than its DLC says, or contains
+ * something other than hex digits and spaces.
+ *
+ * Returns true if the first such character can't start an error
+ * message either, i.e. the line is garbled rather than cut short by
+ * an error message such as BUFFER FULL.
+ */
+static bool can327_line_is_garbled(const u8 *line, size_t len, size_t pos)
+{
+	u8 cc;
+
+	for (; pos < len; pos++) {
+		cc = can327_char_class[line[pos]];
+		if (!(cc & (CAN327_CC_HEX | CAN327_CC_SPACE)))
+			return !(cc & CAN327_CC_MSG);
+	}
+
+	return false;
+}
+
+/* Is this a frame we've sent through a TX peer?
+ * Each one is only matched once, and only for CAN327_BOND_ECHO_MS.
+ */
+static bool can327_is_bond_echo(struct can327 *elm,
+				const struct can_frame *frame)
+{
+	ktime_t oldest = ktime_sub_ms(ktime_get(), CAN327_BOND_ECHO_MS);
+	struct can327_bond_echo *echo;
+	unsigned int i;
+
+	lockdep_assert_held(&elm->lock);
+
+	if (!rcu_access_pointer(elm->bond))
+		return false;
+
+	for (i = 0; i < CAN327_SIZE_BOND_ECHOES; i++) {
+		echo = &elm->bond_echoes[i];
+
+		if (!echo->sent || ktime_before(echo->sent, oldest))
+			continue;
+		if (echo->frame.can_id != frame->can_id ||
+		    echo->frame.len != frame->len)
+			continue;
+		if (!(frame->can_id & CAN_RTR_FLAG) &&
+		    memcmp(echo->frame.data, frame->data, frame->len))
+			continue;
+
+		echo->sent = 0;
+		elm->bond_echoes_suppressed++;
+		return true;
+	}
+
+	return false;
 }
 
 /* Parse CAN frames coming as ASCII from ELM327.
@@ -399,142 +1924,230 @@ static void can327_parse_error(struct can327 *elm, size_t len)
  *
  * where D = DLC, PL = payload byte
  *
+ * With AT S0, the spaces are left out, see can327_nospaces_datastart().
+ *
  * Instead of a payload, RTR indicates a remote request.
  *
  * We will use the spaces and line length to guess the format.
+ * The fields are then decoded in a single pass using
+ * can327_char_class[], and the character classes they consist of are
+ * checked all at once, rather than per digit.
+ *
+ * frame must be zeroed. Returns -ENODATA if the line isn't a frame, and
+ * -EOVERFLOW if it was cut short, e.g. by BUFFER FULL.
  */
-static int can327_parse_frame(struct can327 *elm, size_t len)
+static int can327_parse_frame(struct can327 *elm, const u8 *line,
+			      size_t len, struct can_frame *frame)
 {
-	struct can_frame *frame;
-	struct sk_buff *skb;
-	int hexlen;
-	int datastart;
+	size_t datastart;
+	size_t dataend;
+	size_t pos;
+	int step;		/* Chars per byte, including any space */
+	u8 valid;		/* AND of the classes of all hex digits */
+	u8 sep;			/* AND of the classes of all separators */
+	u8 hi, lo;
+	int ret;
 	int i;
 
 	lockdep_assert_held(&elm->lock);
 
-	skb = alloc_can_skb(elm->dev, &frame);
-	if (!skb)
-		return -ENOMEM;
-
-	/* Find first non-hex and non-space character:
-	 *  - In the simplest case, there is none.
-	 *  - For RTR frames, 'R' is the first non-hex character.
-	 *  - An error message may replace the end of the data line.
-	 */
-	for (hexlen = 0; hexlen <= len; hexlen++) {
-		if (hex_to_bin(elm->rxbuf[hexlen]) < 0 &&
-		    elm->rxbuf[hexlen] != ' ') {
-			break;
-		}
-	}
-
-	/* Sanity check whether the line is really a clean hexdump,
-	 * or terminated by an error message, or contains garbage.
-	 */
-	if (hexlen < len && !isdigit(elm->rxbuf[hexlen]) &&
-	    !isupper(elm->rxbuf[hexlen]) && '<' != elm->rxbuf[hexlen] &&
-	    ' ' != elm->rxbuf[hexlen]) {
-		/* The line is likely garbled anyway, so bail.
-		 * The main code will restart listening.
-		 */
-		kfree_skb(skb);
-		return -ENODATA;
-	}
-
-	/* Use spaces in CAN ID to distinguish 29 or 11 bit address length.
-	 * No out-of-bounds access:
-	 * We use the fact that we can always read from elm->rxbuf.
-	 */
-	if (elm->rxbuf[2] == ' ' && elm->rxbuf[5] == ' ' &&
-	    elm->rxbuf[8] == ' ' && elm->rxbuf[11] == ' ' &&
-	    elm->rxbuf[13] == ' ') {
+	/* Use spaces in CAN ID to distinguish 29 or 11 bit address length. */
+	if (len >= 14 &&
+	    line[2] == ' ' && line[5] == ' ' &&
+	    line[8] == ' ' && line[11] == ' ' &&
+	    line[13] == ' ') {
 		frame->can_id = CAN_EFF_FLAG;
 		datastart = 14;
-	} else if (elm->rxbuf[3] == ' ' && elm->rxbuf[5] == ' ') {
+		step = 3;
+	} else if (len >= 6 && line[3] == ' ' && line[5] == ' ') {
 		datastart = 6;
+		step = 3;
+	} else if (elm->rx_spaces_off) {
+		ret = can327_nospaces_datastart(line, len, &frame->can_id);
+		if (ret < 0)
+			return ret;
+		datastart = ret;
+		step = 2;
 	} else {
 		/* This is not a well-formatted data line.
 		 * Assume it's an error message.
 		 */
-		kfree_skb(skb);
 		return -ENODATA;
 	}
 
-	if (hexlen < datastart) {
-		/* The line is too short to be a valid frame hex dump.
-		 * Something interrupted the hex dump or it is invalid.
+	/* Read CAN ID */
+	valid = CAN327_CC_HEX;
+	if (frame->can_id & CAN_EFF_FLAG) {
+		for (i = 0; i < 4; i++) {
+			hi = can327_char_class[line[step * i]];
+			lo = can327_char_class[line[step * i + 1]];
+			valid &= hi & lo;
+			frame->can_id |=
+				((canid_t)(hi & CAN327_CC_NIBBLE) << (28 - 8 * i)) |
+				((canid_t)(lo & CAN327_CC_NIBBLE) << (24 - 8 * i));
+		}
+	} else {
+		for (i = 0; i < 3; i++) {
+			hi = can327_char_class[line[i]];
+			valid &= hi;
+			frame->can_id |=
+				(canid_t)(hi & CAN327_CC_NIBBLE) << (8 - 4 * i);
+		}
+	}
+
+	/* Read CAN data length */
+	hi = can327_char_class[line[datastart - step + 1]];
+	valid &= hi;
+	frame->len = hi & CAN327_CC_NIBBLE;
+
+	if (!valid || frame->len > CAN_MAX_DLEN) {
+		/* The header is garbled, or the line is something else
+		 * that just happens to have spaces in the right places.
 		 */
-		kfree_skb(skb);
 		return -ENODATA;
 	}
 
-	/* From here on all chars up to buf[hexlen] are hex or spaces,
-	 * at well-defined offsets.
+	/* Check for RTR frame */
+	pos = datastart;
+	if (pos < len && line[pos] == ' ')
+		pos++;
+	if (len - pos >= 3 && !memcmp(&line[pos], "RTR", 3)) {
+		frame->can_id |= CAN_RTR_FLAG;
+		return 0;
+	}
+
+	/* Is the line long enough to hold the advertised payload?
+	 * With spaces, every byte is followed by one.
 	 */
+	dataend = datastart + step * frame->len;
+	if (len < dataend)
+		goto cut_short;
 
-	/* Read CAN data length */
-	frame->len = (hex_to_bin(elm->rxbuf[datastart - 2]) << 0);
+	/* Parse the data nibbles. */
+	sep = CAN327_CC_SPACE;
+	for (i = 0; i < frame->len; i++) {
+		pos = datastart + step * i;
+		hi = can327_char_class[line[pos]];
+		lo = can327_char_class[line[pos + 1]];
+		valid &= hi & lo;
+		if (step == 3)
+			sep &= can327_char_class[line[pos + 2]];
+		frame->data[i] = (hi & CAN327_CC_NIBBLE) << 4 |
+				 (lo & CAN327_CC_NIBBLE);
+	}
 
-	/* Read CAN ID */
-	if (frame->can_id & CAN_EFF_FLAG) {
-		frame->can_id |= (hex_to_bin(elm->rxbuf[0]) << 28) |
-				 (hex_to_bin(elm->rxbuf[1]) << 24) |
-				 (hex_to_bin(elm->rxbuf[3]) << 20) |
-				 (hex_to_bin(elm->rxbuf[4]) << 16) |
-				 (hex_to_bin(elm->rxbuf[6]) << 12) |
-				 (hex_to_bin(elm->rxbuf[7]) << 8) |
-				 (hex_to_bin(elm->rxbuf[9]) << 4) |
-				 (hex_to_bin(elm->rxbuf[10]) << 0);
-	} else {
-		frame->can_id |= (hex_to_bin(elm->rxbuf[0]) << 8) |
-				 (hex_to_bin(elm->rxbuf[1]) << 4) |
-				 (hex_to_bin(elm->rxbuf[2]) << 0);
+	if (!valid || !sep)
+		goto cut_short;
+
+	/* Anything after the payload must not be garbage. */
+	if (can327_line_is_garbled(line, len, dataend))
+		return -ENODATA;
+
+	return 0;
+
+cut_short:
+	/* Something interrupted the hex dump, or it is invalid.
+	 * If it's garbage, bail. The main code will restart listening.
+	 */
+	if (can327_line_is_garbled(line, len, datastart))
+		return -ENODATA;
+
+	/* Incomplete frame.
+	 * Probably the ELM327's RS232 TX buffer was full.
+	 * -EOVERFLOW tells can327_parse_line() to report it as such,
+	 * and that the ELM327 is on its way back to the prompt by itself.
+	 */
+	return -EOVERFLOW;
+}
+
+/* Parse a monitor line, and feed the frame to the network layer. */
+static int can327_rx_frame(struct can327 *elm, const u8 *line, size_t len)
+{
+	struct can_frame *frame;
+	struct sk_buff *skb;
+	int err;
+
+	lockdep_assert_held(&elm->lock);
+
+	skb = can327_alloc_skb(elm, &frame);
+	if (!skb)
+		return -ENOMEM;
+
+	err = can327_parse_frame(elm, line, len, frame);
+	if (err) {
+		can327_free_skb(elm, skb);
+		return err;
 	}
 
-	/* Check for RTR frame */
-	if (elm->rxfill >= hexlen + 3 &&
-	    !memcmp(&elm->rxbuf[hexlen], "RTR", 3)) {
-		frame->can_id |= CAN_RTR_FLAG;
+	/* Our own frame, sent through a TX peer. The stack has already
+	 * echoed it to local sockets.
+	 */
+	if (can327_is_bond_echo(elm, frame)) {
+		can327_free_skb(elm, skb);
+		return 0;
 	}
 
-	/* Is the line long enough to hold the advertised payload?
-	 * Note: RTR frames have a DLC, but no actual payload.
-	 */
-	if (!(frame->can_id & CAN_RTR_FLAG) &&
-	    (hexlen < frame->len * 3 + datastart)) {
-		/* Incomplete frame.
-		 * Probably the ELM327's RS232 TX buffer was full.
-		 * Emit an error frame and exit.
-		 */
-		frame->can_id = CAN_ERR_FLAG | CAN_ERR_CRTL;
-		frame->len = CAN_ERR_DLC;
-		frame->data[1] = CAN_ERR_CRTL_RX_OVERFLOW;
-		can327_feed_frame_to_netdev(elm, skb);
-
-		/* Signal failure to parse.
-		 * The line will be re-parsed as an error line, which will fail.
-		 * However, this will correctly drop the state machine back into
-		 * command mode.
-		 */
-		return -ENODATA;
-	}
+	if (elm->reply_wait && can327_is_reply(elm, frame->can_id))
+		can327_reply_seen(elm);
+
+	can327_feed_frame_to_netdev(elm, skb);
+
+	return 0;
+}
+
+/* The ELM327's UART TX buffer ran full, so it stopped monitoring.
+ * Like after other error messages, it prints a prompt right after
+ * BUFFER FULL, so there's no need to kick it: Staying in
+ * CAN327_STATE_RECEIVING, the prompt will take us to
+ * can327_handle_prompt(), which restarts monitoring with ATMA.
+ * Should the chip keep monitoring after all, its lines are still
+ * parsed as usual.
+ *
+ * If this keeps happening, the UART is too slow for the bus load.
+ * Switch to overflow_baudrate then, if set.
+ */
+static void can327_rx_overflow(struct can327 *elm)
+{
+	unsigned int baud = READ_ONCE(overflow_baudrate);
+
+	lockdep_assert_held(&elm->lock);
+
+	elm->dev->stats.rx_over_errors++;
 
-	/* Parse the data nibbles. */
-	for (i = 0; i < frame->len; i++) {
-		frame->data[i] =
-			(hex_to_bin(elm->rxbuf[datastart + 3 * i]) << 4) |
-			(hex_to_bin(elm->rxbuf[datastart + 3 * i + 1]));
+	if (!elm->rx_overflow_recent ||
+	    time_after(jiffies, elm->rx_overflow_window +
+		       msecs_to_jiffies(CAN327_OVERFLOW_WINDOW_MS))) {
+		elm->rx_overflow_window = jiffies;
+		elm->rx_overflow_recent = 0;
 	}
 
-	/* Feed the frame to the network layer. */
-	can327_feed_frame_to_netdev(elm, skb);
+	if (++elm->rx_overflow_recent < CAN327_OVERFLOW_BURST)
+		return;
 
-	return 0;
+	elm->rx_overflow_recent = 0;
+
+	if (baud && !elm->baud_failed &&
+	    4000000 / can327_brd_divisor(baud) > can327_uart_baud(elm) &&
+	    !test_bit(CAN327_TX_DO_BAUDRATE, &elm->cmds_todo)) {
+		netdev_info(elm->dev,
+			    "ELM327 keeps reporting BUFFER FULL, trying %u baud.\n",
+			    baud);
+		elm->baud_want = baud;
+		set_bit(CAN327_TX_DO_BAUDRATE, &elm->cmds_todo);
+	} else if (net_ratelimit()) {
+		/* Only userspace knows which frames it needs, so we can't
+		 * tighten the hardware filters ourselves. Point it there.
+		 */
+		netdev_warn(elm->dev,
+			    "ELM327 keeps reporting BUFFER FULL. UART too slow for the bus load? Consider hardware CAN ID filters.\n");
+	}
 }
 
-static void can327_parse_line(struct can327 *elm, size_t len)
+static void can327_parse_line(struct can327 *elm, const u8 *line,
+			      size_t len)
 {
+	int err;
+
 	lockdep_assert_held(&elm->lock);
 
 	/* Skip empty lines */
@@ -544,48 +2157,252 @@ static void can327_parse_line(struct can327 *elm, size_t len)
 	/* Skip echo lines */
 	if (elm->drop_next_line) {
 		elm->drop_next_line = 0;
+		can327_tx_complete(elm);
+		if (elm->reply_wait)
+			elm->reply_wait_stamp = elm->rxline_stamp;
+		trace_can327_rx_line(elm->dev, line, len, "echo");
 		return;
-	} else if (!memcmp(elm->rxbuf, "AT", 2)) {
+	} else if (!memcmp(line, "AT", 2) ||
+		   can327_rxbuf_cmp(line, len, "STMA")) {
+		trace_can327_rx_line(elm->dev, line, len, "echo");
+		return;
+	}
+
+	if (elm->state != CAN327_STATE_RECEIVING) {
+		trace_can327_rx_line(elm->dev, line, len, "ignored");
 		return;
 	}
 
 	/* Regular parsing */
-	if (elm->state == CAN327_STATE_RECEIVING &&
-	    can327_parse_frame(elm, len)) {
+	err = can327_rx_frame(elm, line, len);
+	if (!err) {
+		trace_can327_rx_line(elm->dev, line, len, "frame");
+		elm->perf.rx_frames++;
+	} else if (err == -ENOMEM) {
+		/* The line is fine, we just couldn't allocate the frame.
+		 * Leaving monitor mode won't help that.
+		 */
+		trace_can327_rx_line(elm->dev, line, len, "nomem");
+		elm->dev->stats.rx_dropped++;
+	} else {
 		/* Parse an error line. */
-		can327_parse_error(elm, len);
+		enum can327_err kind = err == -EOVERFLOW ?
+				       CAN327_ERR_BUFFER_FULL :
+				       can327_parse_error(elm, line, len);
+
+		trace_can327_rx_line(elm->dev, line, len,
+				     can327_errs[kind].name);
+		can327_rx_error(elm, kind);
+
+		if (kind == CAN327_ERR_BUFFER_FULL)
+			can327_rx_overflow(elm);
+
+		/* BUFFER FULL ends monitoring with a prompt, which
+		 * restarts it. After anything else, we can't be sure
+		 * whether the ELM327 is still monitoring, so start
+		 * afresh. Further errors until then are ignored, so this
+		 * is only one kick per error storm.
+		 */
+		if (kind != CAN327_ERR_BUFFER_FULL)
+			can327_kick_into_cmd_mode(elm);
+	}
+}
 
-		/* Start afresh. */
-		can327_kick_into_cmd_mode(elm);
+static void can327_skip_if_known(struct can327 *elm, enum can327_tx_do cmd,
+				 bool same)
+{
+	if (same && test_bit(cmd, &elm->shadow_known) &&
+	    test_and_clear_bit(cmd, &elm->cmds_todo))
+		elm->cmds_skipped++;
+}
+
+/* AT S0 saves bandwidth, but only if the user asks for it:
+ * Clones claiming v1.3 may not implement it.
+ * Chips too old for it don't get it either way.
+ */
+static bool can327_want_spaces_off(const struct can327 *elm)
+{
+	if (test_bit(CAN327_CAP_ATI, &elm->caps) &&
+	    !test_bit(CAN327_CAP_SPACES_OFF, &elm->caps))
+		return false;
+
+	return READ_ONCE(spaces_off);
+}
+
+/* Drop commands that wouldn't change the ELM327's configuration. */
+static void can327_skip_known_cmds(struct can327 *elm)
+{
+	struct can_frame *frame = &elm->can_frame_to_send;
+	bool listen_only = elm->can.ctrlmode & CAN_CTRLMODE_LISTENONLY;
+
+	lockdep_assert_held(&elm->lock);
+
+	/* We don't know yet whether the shadow state is still valid,
+	 * or what the chip supports.
+	 */
+	if (test_bit(CAN327_TX_DO_WARM_CHECK, &elm->cmds_todo) ||
+	    elm->cmds_todo & CAN327_TX_DO_PROBE_MASK)
+		return;
+
+	/* Don't try AT BRD on chips that are too old for it */
+	if (test_bit(CAN327_CAP_ATI, &elm->caps) &&
+	    !test_bit(CAN327_CAP_BAUDRATE, &elm->caps) &&
+	    test_and_clear_bit(CAN327_TX_DO_BAUDRATE, &elm->cmds_todo))
+		netdev_info(elm->dev, "ELM327 does not support AT BRD.\n");
+
+	/* The init script turns spaces on, so this is always known */
+	if (elm->rx_spaces_off == can327_want_spaces_off(elm))
+		clear_bit(CAN327_TX_DO_SPACES, &elm->cmds_todo);
+
+	can327_skip_if_known(elm, CAN327_TX_DO_SILENT_MONITOR,
+			     elm->shadow.silent_monitor == listen_only);
+	can327_skip_if_known(elm, CAN327_TX_DO_RESPONSES,
+			     elm->shadow.responses ==
+			     (!listen_only && !elm->tx_burst));
+	can327_skip_if_known(elm, CAN327_TX_DO_REPLY_TIMEOUT,
+			     elm->shadow.reply_timeout == elm->reply_timeout);
+	can327_skip_if_known(elm, CAN327_TX_DO_CAN_FILTER,
+			     !memcmp(&elm->shadow.filters, &elm->hw_filters,
+				     sizeof(elm->hw_filters)));
+	can327_skip_if_known(elm, CAN327_TX_DO_CAN_CONFIG,
+			     elm->shadow.can_config == elm->can_config);
+
+	can327_skip_if_known(elm, CAN327_TX_DO_FC_HEADER,
+			     elm->shadow.fc.fc_id == elm->fc.fc_id);
+	can327_skip_if_known(elm, CAN327_TX_DO_FC_DATA,
+			     elm->shadow.fc.block_size == elm->fc.block_size &&
+			     elm->shadow.fc.st_min == elm->fc.st_min);
+	can327_skip_if_known(elm, CAN327_TX_DO_FC_MODE, true);
+	can327_skip_if_known(elm, CAN327_TX_DO_FC_ENABLE,
+			     elm->shadow.fc_on == elm->fc_on);
+
+	/* AT SH with 3 digits sets the same header bytes as with 6 */
+	can327_skip_if_known(elm, CAN327_TX_DO_CANID_29BIT_HIGH,
+			     elm->shadow.priority ==
+			     (frame->can_id & CAN_EFF_MASK) >> 24);
+	can327_skip_if_known(elm, CAN327_TX_DO_CANID_29BIT_LOW,
+			     elm->shadow.header ==
+			     (frame->can_id & CAN_EFF_MASK & ((1 << 24) - 1)));
+	can327_skip_if_known(elm, CAN327_TX_DO_CANID_11BIT,
+			     elm->shadow.header ==
+			     (frame->can_id & CAN_SFF_MASK));
+}
+
+/* Find a single filter for chips without pass filters.
+ * It lets through every frame matching any of elm->hw_filters.
+ */
+static void can327_merge_hw_filters(const struct can327 *elm,
+				    struct can327_hw_filter *merged)
+{
+	const struct can327_hw_filter_list *list = &elm->hw_filters;
+	unsigned int i;
+
+	memset(merged, 0, sizeof(*merged));
+	if (!list->count)
+		return;
+
+	*merged = list->filter[0];
+	for (i = 1; i < list->count; i++) {
+		const struct can327_hw_filter *f = &list->filter[i];
+
+		if ((f->can_id ^ merged->can_id) & CAN_EFF_FLAG) {
+			/* SFF and EFF: Receive everything. */
+			memset(merged, 0, sizeof(*merged));
+			return;
+		}
+
+		/* Only compare bits that all filters agree on */
+		merged->can_mask &= f->can_mask &
+				    ~(f->can_id ^ merged->can_id);
 	}
 }
 
+/* Parse the next line as the reply to cmd. See can327_handle_reply(). */
+static void can327_expect_reply(struct can327 *elm, enum can327_tx_do cmd)
+{
+	lockdep_assert_held(&elm->lock);
+
+	elm->reply_to = cmd;
+	can327_set_state(elm, CAN327_STATE_GETREPLY);
+}
+
 static void can327_handle_prompt(struct can327 *elm)
 {
 	struct can_frame *frame = &elm->can_frame_to_send;
 	/* Size this buffer for the largest ELM327 line we may generate,
-	 * which is currently an 8 byte CAN frame's payload hexdump.
+	 * which is currently an 8 byte EFF frame sent with STPX.
 	 * Items in can327_init_script must fit here, too!
 	 */
-	char local_txbuf[sizeof("0102030405060708\r")];
+	char local_txbuf[sizeof("STPXH:12345678,D:0102030405060708,R:0\r")];
+	unsigned long todo;
 
 	lockdep_assert_held(&elm->lock);
 
+	/* Any reply would have arrived before the prompt */
+	elm->reply_wait = false;
+
+	/* Likewise the echo of the last frame, if there was one */
+	can327_tx_complete(elm);
+
+	elm->perf.prompts++;
+
+	can327_skip_known_cmds(elm);
+
 	if (!elm->cmds_todo) {
-		/* Enter CAN monitor mode */
-		can327_send(elm, "ATMA\r", 5);
-		elm->state = CAN327_STATE_RECEIVING;
+		struct can327_tx_frame next;
+
+		if (!can327_tx_dequeue(elm, &next)) {
+			/* Nothing left to send. Enter CAN monitor mode. */
+			can327_send(elm, elm->backend->monitor,
+				    strlen(elm->backend->monitor));
+			elm->perf.monitor_starts++;
+			can327_set_state(elm, CAN327_STATE_RECEIVING);
+
+			/* Pairs with smp_mb() in can327_netdev_start_xmit():
+			 * If a frame was queued meanwhile, we see it here.
+			 * Otherwise, start_xmit sees us in monitor mode.
+			 */
+			smp_mb();
+			if (can327_tx_pending(elm))
+				can327_kick_into_cmd_mode(elm);
+
+			return;
+		}
 
-		/* We will be in the default state once this command is
-		 * sent, so enable the TX packet queue.
+		/* Dequeue the next frame while we're in command mode.
+		 * If more frames are waiting behind it, stay in command mode.
+		 * There is room in the TX FIFO again, so enable the
+		 * TX packet queue in case it was stopped. See
+		 * can327_netdev_start_xmit() for why this can't race.
 		 */
+		can327_send_frame(elm, &next.frame);
+		elm->tx_queued = next.queued;
+		elm->tx_echo = next.echo;
+		elm->tx_echo_pending = true;
+		elm->tx_echo_sent = false;
+		can327_set_tx_burst(elm, can327_tx_pending(elm));
+		if (!elm->tx_burst)
+			can327_select_reply_timeout(elm, next.frame.can_id);
 		netif_wake_queue(elm->dev);
 
-		return;
+		can327_skip_known_cmds(elm);
 	}
 
+	if (test_bit(CAN327_TX_DO_CAN_DATA, &elm->cmds_todo))
+		elm->perf.tx_prompts++;
+
+	todo = elm->cmds_todo;
+
 	/* Reconfigure ELM327 step by step as indicated by elm->cmds_todo */
-	if (test_bit(CAN327_TX_DO_INIT, &elm->cmds_todo)) {
+	if (test_and_clear_bit(CAN327_TX_DO_WARM_CHECK, &elm->cmds_todo)) {
+		/* Our init script selects protocol B. After a reset,
+		 * the ELM327 will be back to its default protocol.
+		 * See can327_handle_reply().
+		 */
+		snprintf(local_txbuf, sizeof(local_txbuf), "ATDPN\r");
+		can327_expect_reply(elm, CAN327_TX_DO_WARM_CHECK);
+
+	} else if (test_bit(CAN327_TX_DO_INIT, &elm->cmds_todo)) {
 		snprintf(local_txbuf, sizeof(local_txbuf), "%s",
 			 *elm->next_init_cmd);
 
@@ -593,44 +2410,230 @@ static void can327_handle_prompt(struct can327 *elm)
 		if (!(*elm->next_init_cmd)) {
 			clear_bit(CAN327_TX_DO_INIT, &elm->cmds_todo);
 			/* Init finished. */
+
+			/* The init script set these explicitly. */
+			elm->shadow.header = 0x7df;
+			elm->shadow.reply_timeout = 0xff;
+			memset(&elm->shadow.filters, 0,
+			       sizeof(elm->shadow.filters));
+			elm->shadow.fc_on = false;
+			elm->shadow_known = BIT(CAN327_TX_DO_CANID_11BIT) |
+					    BIT(CAN327_TX_DO_CANID_29BIT_LOW) |
+					    BIT(CAN327_TX_DO_CAN_FILTER) |
+					    BIT(CAN327_TX_DO_REPLY_TIMEOUT) |
+					    BIT(CAN327_TX_DO_FC_ENABLE);
+			elm->warm = true;
 		}
 
+	} else if (test_and_clear_bit(CAN327_TX_DO_PROBE_ATI, &elm->cmds_todo)) {
+		snprintf(local_txbuf, sizeof(local_txbuf), "ATI\r");
+		can327_expect_reply(elm, CAN327_TX_DO_PROBE_ATI);
+
+	} else if (test_and_clear_bit(CAN327_TX_DO_PROBE_STI, &elm->cmds_todo)) {
+		snprintf(local_txbuf, sizeof(local_txbuf), "STI\r");
+		can327_expect_reply(elm, CAN327_TX_DO_PROBE_STI);
+
+	} else if (test_and_clear_bit(CAN327_TX_DO_PROBE_AT1, &elm->cmds_todo)) {
+		snprintf(local_txbuf, sizeof(local_txbuf), "AT@1\r");
+		can327_expect_reply(elm, CAN327_TX_DO_PROBE_AT1);
+
+	} else if (test_and_clear_bit(CAN327_TX_DO_BAUDRATE, &elm->cmds_todo)) {
+		u8 divisor = can327_brd_divisor(elm->baud_want);
+
+		elm->baud_old = can327_uart_baud(elm);
+		elm->baud_next = 4000000 / divisor;
+
+		snprintf(local_txbuf, sizeof(local_txbuf),
+			 "ATBRD%02X\r", divisor);
+
+		/* Wait for OK before switching. See can327_parse_baud_line(). */
+		can327_set_state(elm, CAN327_STATE_BAUD_GETOK);
+		schedule_delayed_work(&elm->baud_timeout_work,
+				      msecs_to_jiffies(CAN327_BAUD_TIMEOUT_MS));
+
+	} else if (test_and_clear_bit(CAN327_TX_DO_SPACES, &elm->cmds_todo)) {
+		/* Lines with spaces are still parsed, in case the
+		 * chip doesn't understand AT S0.
+		 */
+		elm->rx_spaces_off = can327_want_spaces_off(elm);
+
+		snprintf(local_txbuf, sizeof(local_txbuf),
+			 "ATS%i\r", !elm->rx_spaces_off);
+
 	} else if (test_and_clear_bit(CAN327_TX_DO_SILENT_MONITOR, &elm->cmds_todo)) {
+		elm->shadow.silent_monitor =
+			elm->can.ctrlmode & CAN_CTRLMODE_LISTENONLY;
+		set_bit(CAN327_TX_DO_SILENT_MONITOR, &elm->shadow_known);
+
 		snprintf(local_txbuf, sizeof(local_txbuf),
-			 "ATCSM%i\r",
-			 !!(elm->can.ctrlmode & CAN_CTRLMODE_LISTENONLY));
+			 "ATCSM%i\r", elm->shadow.silent_monitor);
 
 	} else if (test_and_clear_bit(CAN327_TX_DO_RESPONSES, &elm->cmds_todo)) {
+		elm->shadow.responses =
+			!(elm->can.ctrlmode & CAN_CTRLMODE_LISTENONLY) &&
+			!elm->tx_burst;
+		set_bit(CAN327_TX_DO_RESPONSES, &elm->shadow_known);
+
+		snprintf(local_txbuf, sizeof(local_txbuf),
+			 "ATR%i\r", elm->shadow.responses);
+
+	} else if (test_and_clear_bit(CAN327_TX_DO_REPLY_TIMEOUT, &elm->cmds_todo)) {
+		elm->shadow.reply_timeout = elm->reply_timeout;
+		set_bit(CAN327_TX_DO_REPLY_TIMEOUT, &elm->shadow_known);
+
+		snprintf(local_txbuf, sizeof(local_txbuf),
+			 "ATST%02X\r", elm->shadow.reply_timeout);
+
+	} else if (elm->backend->pass_filters &&
+		   test_and_clear_bit(CAN327_TX_DO_CAN_FILTER, &elm->cmds_todo)) {
+		/* Start over, then add the filters one by one */
+		snprintf(local_txbuf, sizeof(local_txbuf), "STFCP\r");
+
+		elm->next_pass_filter = 0;
+		if (elm->hw_filters.count) {
+			set_bit(CAN327_TX_DO_CAN_PASS_FILTER, &elm->cmds_todo);
+
+			/* Known again once all of them have been sent */
+			clear_bit(CAN327_TX_DO_CAN_FILTER, &elm->shadow_known);
+		} else {
+			elm->shadow.filters = elm->hw_filters;
+			set_bit(CAN327_TX_DO_CAN_FILTER, &elm->shadow_known);
+		}
+
+	} else if (test_and_clear_bit(CAN327_TX_DO_CAN_PASS_FILTER, &elm->cmds_todo)) {
+		struct can327_hw_filter *filter =
+			&elm->hw_filters.filter[elm->next_pass_filter++];
+		bool eff = filter->can_id & CAN_EFF_FLAG;
+		u32 full_mask = eff ? CAN_EFF_MASK : CAN_SFF_MASK;
+
+		/* The number of digits tells SFF and EFF apart */
 		snprintf(local_txbuf, sizeof(local_txbuf),
-			 "ATR%i\r",
-			 !(elm->can.ctrlmode & CAN_CTRLMODE_LISTENONLY));
+			 eff ? "STFAP%08X,%08X\r" : "STFAP%03X,%03X\r",
+			 filter->can_id & full_mask, filter->can_mask);
+
+		if (elm->next_pass_filter < elm->hw_filters.count) {
+			set_bit(CAN327_TX_DO_CAN_PASS_FILTER, &elm->cmds_todo);
+		} else {
+			elm->shadow.filters = elm->hw_filters;
+			set_bit(CAN327_TX_DO_CAN_FILTER, &elm->shadow_known);
+		}
+
+	} else if (test_and_clear_bit(CAN327_TX_DO_CAN_FILTER, &elm->cmds_todo)) {
+		struct can327_hw_filter filter;
+		bool eff;
+		u32 full_mask;
+
+		can327_merge_hw_filters(elm, &filter);
+		eff = filter.can_id & CAN_EFF_FLAG;
+		full_mask = eff ? CAN_EFF_MASK : CAN_SFF_MASK;
+
+		if (filter.can_mask == full_mask) {
+			/* Only a single CAN ID is wanted.
+			 * AT CRA sets both filter and mask in one go.
+			 */
+			snprintf(local_txbuf, sizeof(local_txbuf),
+				 eff ? "ATCRA%08X\r" : "ATCRA%03X\r",
+				 filter.can_id & full_mask);
+
+			elm->shadow.filters = elm->hw_filters;
+			set_bit(CAN327_TX_DO_CAN_FILTER, &elm->shadow_known);
+		} else {
+			snprintf(local_txbuf, sizeof(local_txbuf),
+				 eff ? "ATCF%08X\r" : "ATCF%03X\r",
+				 filter.can_id & full_mask);
+			set_bit(CAN327_TX_DO_CAN_MASK, &elm->cmds_todo);
+
+			/* Known again once the mask has been sent */
+			clear_bit(CAN327_TX_DO_CAN_FILTER, &elm->shadow_known);
+		}
+
+	} else if (test_and_clear_bit(CAN327_TX_DO_CAN_MASK, &elm->cmds_todo)) {
+		struct can327_hw_filter filter;
+
+		can327_merge_hw_filters(elm, &filter);
+		snprintf(local_txbuf, sizeof(local_txbuf),
+			 filter.can_id & CAN_EFF_FLAG ? "ATCM%08X\r" : "ATCM%03X\r",
+			 filter.can_mask);
+
+		/* AT CF was sent for these filters right before. */
+		elm->shadow.filters = elm->hw_filters;
+		set_bit(CAN327_TX_DO_CAN_FILTER, &elm->shadow_known);
 
 	} else if (test_and_clear_bit(CAN327_TX_DO_CAN_CONFIG, &elm->cmds_todo)) {
 		snprintf(local_txbuf, sizeof(local_txbuf),
 			 "ATPC\r");
 		set_bit(CAN327_TX_DO_CAN_CONFIG_PART2, &elm->cmds_todo);
+		clear_bit(CAN327_TX_DO_CAN_CONFIG, &elm->shadow_known);
 
 	} else if (test_and_clear_bit(CAN327_TX_DO_CAN_CONFIG_PART2, &elm->cmds_todo)) {
 		snprintf(local_txbuf, sizeof(local_txbuf),
 			 "ATPB%04X\r",
 			 elm->can_config);
 
+		elm->shadow.can_config = elm->can_config;
+		set_bit(CAN327_TX_DO_CAN_CONFIG, &elm->shadow_known);
+
+	} else if (test_and_clear_bit(CAN327_TX_DO_FC_HEADER, &elm->cmds_todo)) {
+		bool eff = elm->fc.fc_id & CAN_EFF_FLAG;
+
+		elm->shadow.fc.fc_id = elm->fc.fc_id;
+		set_bit(CAN327_TX_DO_FC_HEADER, &elm->shadow_known);
+
+		snprintf(local_txbuf, sizeof(local_txbuf),
+			 eff ? "ATFCSH%08X\r" : "ATFCSH%03X\r",
+			 elm->fc.fc_id & (eff ? CAN_EFF_MASK : CAN_SFF_MASK));
+
+	} else if (test_and_clear_bit(CAN327_TX_DO_FC_DATA, &elm->cmds_todo)) {
+		elm->shadow.fc.block_size = elm->fc.block_size;
+		elm->shadow.fc.st_min = elm->fc.st_min;
+		set_bit(CAN327_TX_DO_FC_DATA, &elm->shadow_known);
+
+		/* Flow status: Continue To Send */
+		snprintf(local_txbuf, sizeof(local_txbuf),
+			 "ATFCSD30%02X%02X\r",
+			 elm->fc.block_size, elm->fc.st_min);
+
+	} else if (test_and_clear_bit(CAN327_TX_DO_FC_MODE, &elm->cmds_todo)) {
+		set_bit(CAN327_TX_DO_FC_MODE, &elm->shadow_known);
+
+		/* Use the header and data set above */
+		snprintf(local_txbuf, sizeof(local_txbuf), "ATFCSM1\r");
+
+	} else if (test_and_clear_bit(CAN327_TX_DO_FC_ENABLE, &elm->cmds_todo)) {
+		elm->shadow.fc_on = elm->fc_on;
+		set_bit(CAN327_TX_DO_FC_ENABLE, &elm->shadow_known);
+
+		snprintf(local_txbuf, sizeof(local_txbuf),
+			 "ATCFC%i\r", elm->fc_on);
+
 	} else if (test_and_clear_bit(CAN327_TX_DO_CANID_29BIT_HIGH, &elm->cmds_todo)) {
+		elm->shadow.priority = (frame->can_id & CAN_EFF_MASK) >> 24;
+		set_bit(CAN327_TX_DO_CANID_29BIT_HIGH, &elm->shadow_known);
+
 		snprintf(local_txbuf, sizeof(local_txbuf),
-			 "ATCP%02X\r",
-			 (frame->can_id & CAN_EFF_MASK) >> 24);
+			 "ATCP%02X\r", elm->shadow.priority);
 
 	} else if (test_and_clear_bit(CAN327_TX_DO_CANID_29BIT_LOW, &elm->cmds_todo)) {
+		elm->shadow.header = frame->can_id & CAN_EFF_MASK &
+				     ((1 << 24) - 1);
+		elm->shadow_known |= BIT(CAN327_TX_DO_CANID_11BIT) |
+				     BIT(CAN327_TX_DO_CANID_29BIT_LOW);
+
 		snprintf(local_txbuf, sizeof(local_txbuf),
-			 "ATSH%06X\r",
-			 frame->can_id & CAN_EFF_MASK & ((1 << 24) - 1));
+			 "ATSH%06X\r", elm->shadow.header);
 
 	} else if (test_and_clear_bit(CAN327_TX_DO_CANID_11BIT, &elm->cmds_todo)) {
+		elm->shadow.header = frame->can_id & CAN_SFF_MASK;
+		elm->shadow_known |= BIT(CAN327_TX_DO_CANID_11BIT) |
+				     BIT(CAN327_TX_DO_CANID_29BIT_LOW);
+
 		snprintf(local_txbuf, sizeof(local_txbuf),
-			 "ATSH%03X\r",
-			 frame->can_id & CAN_SFF_MASK);
+			 "ATSH%03X\r", elm->shadow.header);
 
 	} else if (test_and_clear_bit(CAN327_TX_DO_CAN_DATA, &elm->cmds_todo)) {
+		elm->perf.tx_frames++;
+		elm->tx_echo_sent = true;
+
 		if (frame->can_id & CAN_RTR_FLAG) {
 			/* Send an RTR frame. Their DLC is fixed.
 			 * Some chips don't send them at all.
@@ -638,28 +2641,254 @@ static void can327_handle_prompt(struct can327 *elm)
 			snprintf(local_txbuf, sizeof(local_txbuf), "ATRTR\r");
 		} else {
 			/* Send a regular CAN data frame */
+			bool eff = frame->can_id & CAN_EFF_FLAG;
+			int pos = 0;
 			int i;
 
+			/* STN chips take the header in the same line */
+			if (can327_tx_one_shot(elm, frame))
+				pos = snprintf(local_txbuf, sizeof(local_txbuf),
+					       eff ? "STPXH:%08X,D:" : "STPXH:%03X,D:",
+					       frame->can_id & (eff ? CAN_EFF_MASK :
+								CAN_SFF_MASK));
+
 			for (i = 0; i < frame->len; i++) {
-				snprintf(&local_txbuf[2 * i],
-					 sizeof(local_txbuf), "%02X",
-					 frame->data[i]);
+				snprintf(&local_txbuf[pos + 2 * i],
+					 sizeof(local_txbuf) - pos - 2 * i,
+					 "%02X", frame->data[i]);
 			}
 
-			snprintf(&local_txbuf[2 * i], sizeof(local_txbuf),
-				 "\r");
+			/* STPX may wait for replies regardless of AT R0,
+			 * so tell it not to.
+			 */
+			snprintf(&local_txbuf[pos + 2 * i],
+				 sizeof(local_txbuf) - pos - 2 * i, "%s\r",
+				 pos && elm->tx_burst ? ",R:0" : "");
+		}
+
+		if (elm->tx_burst) {
+			/* Responses are off, so the ELM327 will print
+			 * a prompt right after sending the frame.
+			 */
+			can327_set_state(elm, CAN327_STATE_GETPROMPT);
+		} else {
+			elm->drop_next_line = 1;
+			can327_set_state(elm, CAN327_STATE_RECEIVING);
+
+			/* Time the reply, starting at the echo */
+			elm->reply_wait = READ_ONCE(reply_timeout_adapt) &&
+					  elm->shadow.responses;
+			elm->reply_wait_id = frame->can_id &
+					     (CAN_EFF_FLAG | CAN_EFF_MASK);
+			elm->reply_wait_stamp = 0;
+		}
+	}
+
+	trace_can327_cmds_todo(elm->dev, todo, elm->cmds_todo);
+	can327_send(elm, local_txbuf, strlen(local_txbuf));
+
+	/* More frames arrived while sending this one without TX burst
+	 * mode? Then abort waiting for replies, and send the next frame
+	 * as soon as we're back at the prompt.
+	 *
+	 * Pairs with smp_mb() in can327_netdev_start_xmit().
+	 */
+	smp_mb();
+	if (elm->state == CAN327_STATE_RECEIVING && can327_tx_pending(elm))
+		can327_kick_into_cmd_mode(elm);
+}
+
+/* Switch the TTY to elm->baud_next.
+ * This may sleep, so it can't be done from the RX path.
+ */
+static void can327_baud_worker(struct work_struct *work)
+{
+	struct can327 *elm = container_of(work, struct can327, baud_work);
+	struct ktermios termios;
+	unsigned int baud;
+
+	spin_lock_bh(&elm->lock);
+	baud = elm->baud_next;
+	spin_unlock_bh(&elm->lock);
+
+	down_read(&elm->tty->termios_rwsem);
+	termios = elm->tty->termios;
+	up_read(&elm->tty->termios_rwsem);
+
+	tty_termios_encode_baud_rate(&termios, baud, baud);
+	tty_set_termios(elm->tty, &termios);
+
+	spin_lock_bh(&elm->lock);
+	can327_update_byte_time(elm);
+	spin_unlock_bh(&elm->lock);
+}
+
+/* The ELM327 didn't identify itself at the new baud rate,
+ * so it will have returned to the old one. Follow it there.
+ */
+static void can327_baud_timeout_worker(struct work_struct *work)
+{
+	struct can327 *elm = container_of(to_delayed_work(work),
+					  struct can327, baud_timeout_work);
+
+	spin_lock_bh(&elm->lock);
+	if (elm->state != CAN327_STATE_BAUD_GETOK &&
+	    elm->state != CAN327_STATE_BAUD_GETID) {
+		spin_unlock_bh(&elm->lock);
+		return;
+	}
+
+	netdev_warn(elm->dev,
+		    "ELM327 did not confirm %u baud, staying at %u baud.\n",
+		    elm->baud_next, elm->baud_old);
+
+	elm->baud_failed = true;
+	elm->baud_next = elm->baud_old;
+	spin_unlock_bh(&elm->lock);
+
+	can327_baud_worker(&elm->baud_work);
+
+	/* Start afresh at the old baud rate. */
+	spin_lock_bh(&elm->lock);
+	can327_drop_all_bytes(elm);
+	can327_set_state(elm, CAN327_STATE_NOTINIT);
+	can327_kick_into_cmd_mode(elm);
+	spin_unlock_bh(&elm->lock);
+
+	can327_tx_flush(elm);
+}
+
+/* Follow the AT BRD handshake:
+ *  - The ELM327 confirms the command with OK at the old baud rate.
+ *  - It then switches to the new baud rate and prints its ID.
+ *  - If we reply with a CR in time, it keeps the new baud rate and
+ *    prints a prompt. Otherwise, it returns to the old baud rate.
+ */
+static void can327_parse_baud_line(struct can327 *elm, const u8 *line,
+				   size_t len)
+{
+	lockdep_assert_held(&elm->lock);
+
+	if (elm->state == CAN327_STATE_BAUD_GETOK) {
+		if (can327_rxbuf_cmp(line, len, "OK")) {
+			can327_set_state(elm, CAN327_STATE_BAUD_GETID);
+			schedule_work(&elm->baud_work);
+			mod_delayed_work(system_wq, &elm->baud_timeout_work,
+					 msecs_to_jiffies(CAN327_BAUD_TIMEOUT_MS));
+		} else if (len && memcmp(line, "AT", 2)) {
+			/* Not supported. A prompt will follow. */
+			netdev_info(elm->dev,
+				    "ELM327 does not support AT BRD.\n");
+			elm->baud_failed = true;
+			can327_set_state(elm, CAN327_STATE_GETPROMPT);
+			cancel_delayed_work(&elm->baud_timeout_work);
 		}
+	} else if (len >= 6 && !memcmp(line, "ELM327", 6)) {
+		/* Confirm the new baud rate. OK and a prompt will follow. */
+		can327_send(elm, "\r", 1);
+		can327_set_state(elm, CAN327_STATE_GETPROMPT);
+		cancel_delayed_work(&elm->baud_timeout_work);
+		elm->baud_now = elm->baud_next;
+
+		netdev_info(elm->dev, "UART switched to %u baud.\n",
+			    elm->baud_next);
+	}
+
+	/* Anything else at this point is garbage from switching
+	 * baud rates. Ignore it.
+	 */
+}
+
+/* Learn the ELM327 version from its reply to ATI, e.g. "ELM327 v1.4b" */
+static void can327_parse_ati(struct can327 *elm, const u8 *line, size_t len)
+{
+	unsigned int major, minor;
+
+	lockdep_assert_held(&elm->lock);
+
+	len = min(len, sizeof(elm->chip_id) - 1);
+	memcpy(elm->chip_id, line, len);
+	elm->chip_id[len] = '\0';
+	set_bit(CAN327_CAP_ATI, &elm->caps);
+
+	if (sscanf(elm->chip_id, "ELM327 v%u.%u", &major, &minor) != 2)
+		return;
+
+	if (major > 1 || minor >= 2)
+		set_bit(CAN327_CAP_BAUDRATE, &elm->caps);
+	if (major > 1 || minor >= 3)
+		set_bit(CAN327_CAP_SPACES_OFF, &elm->caps);
+}
+
+/* Evaluate the reply to elm->reply_to.
+ * line is NULL if the ELM327 returned to the prompt without replying.
+ */
+static void can327_handle_reply(struct can327 *elm, const u8 *line,
+				size_t len)
+{
+	bool understood = line && !can327_rxbuf_cmp(line, len, "?");
 
-		elm->drop_next_line = 1;
-		elm->state = CAN327_STATE_RECEIVING;
+	lockdep_assert_held(&elm->lock);
 
-		/* We will be in the default state once this command is
-		 * sent, so enable the TX packet queue.
+	switch (elm->reply_to) {
+	case CAN327_TX_DO_WARM_CHECK:
+		/* If the ELM327 still uses protocol B, it hasn't been
+		 * reset since we ran the init script. Otherwise, run the
+		 * script again before anything else.
 		 */
-		netif_wake_queue(elm->dev);
+		if (!line || (!can327_rxbuf_cmp(line, len, "B") &&
+			      !can327_rxbuf_cmp(line, len, "AB"))) {
+			netdev_info(elm->dev,
+				    "ELM327 has been reset, initialising it again.\n");
+			can327_start_init_script(elm);
+		}
+		break;
+
+	case CAN327_TX_DO_PROBE_ATI:
+		if (understood)
+			can327_parse_ati(elm, line, len);
+		break;
+
+	case CAN327_TX_DO_PROBE_STI:
+		if (understood) {
+			netdev_info(elm->dev, "Found STN chip %.*s.\n",
+				    (int)len, line);
+			set_bit(CAN327_CAP_STN, &elm->caps);
+
+			if (READ_ONCE(stn)) {
+				elm->backend = &can327_backend_stn;
+
+				/* We don't know the STN filters yet */
+				clear_bit(CAN327_TX_DO_CAN_FILTER,
+					  &elm->shadow_known);
+			}
+		}
+		break;
+
+	case CAN327_TX_DO_PROBE_AT1:
+		if (understood)
+			set_bit(CAN327_CAP_AT1, &elm->caps);
+		break;
+
+	default:
+		break;
 	}
 
-	can327_send(elm, local_txbuf, strlen(local_txbuf));
+	/* A prompt will follow. */
+	can327_set_state(elm, CAN327_STATE_GETPROMPT);
+}
+
+static void can327_parse_reply_line(struct can327 *elm, const u8 *line,
+				    size_t len)
+{
+	lockdep_assert_held(&elm->lock);
+
+	/* Skip empty lines and echo. STN replies start with ST, too. */
+	if (!len || (len >= 2 && !memcmp(line, "AT", 2)) ||
+	    can327_rxbuf_cmp(line, len, "STI"))
+		return;
+
+	can327_handle_reply(elm, line, len);
 }
 
 static bool can327_is_ready_char(char c)
@@ -670,90 +2899,222 @@ static bool can327_is_ready_char(char c)
 	return (c & 0x3f) == CAN327_READY_CHAR;
 }
 
-static void can327_drop_bytes(struct can327 *elm, size_t i)
+/* Look for the next <CR>, starting where we stopped looking last time.
+ * The <CR>s were already marked in elm->rxcrmap while receiving,
+ * so only the bitmap needs searching.
+ *
+ * Returns the length of the line before it, or -1 if there is none yet.
+ */
+static int can327_find_line(struct can327 *elm)
 {
+	unsigned int head = can327_rxhead(elm);
+
 	lockdep_assert_held(&elm->lock);
 
-	memmove(&elm->rxbuf[0], &elm->rxbuf[i], CAN327_SIZE_RXBUF - i);
-	elm->rxfill -= i;
+	while (elm->rxscan != head) {
+		unsigned int start = elm->rxscan & (elm->rxbuf_size - 1);
+		unsigned int end = start + min(head - elm->rxscan,
+					       elm->rxbuf_size - start);
+		unsigned int cr = find_next_bit(elm->rxcrmap, end, start);
+
+		elm->rxscan += min(cr, end) - start;
+		if (cr < end)
+			return elm->rxscan - elm->rxtail;
+	}
+
+	return -1;
 }
 
-static void can327_parse_rxbuf(struct can327 *elm, size_t first_new_char_idx)
+/* Get a contiguous view of the line at the start of the RX buffer,
+ * including its <CR>. Only lines wrapping around the end of the ring
+ * buffer are copied, to elm->rxline.
+ */
+static const u8 *can327_line_view(struct can327 *elm, unsigned int len)
 {
-	size_t len, pos;
+	unsigned int start = elm->rxtail & (elm->rxbuf_size - 1);
+	unsigned int first = elm->rxbuf_size - start;
 
 	lockdep_assert_held(&elm->lock);
 
-	switch (elm->state) {
-	case CAN327_STATE_NOTINIT:
-		elm->rxfill = 0;
-		break;
+	if (len < first)
+		return &elm->rxbuf[start];
 
-	case CAN327_STATE_GETDUMMYCHAR:
-		/* Wait for 'y' or '>' */
-		for (pos = 0; pos < elm->rxfill; pos++) {
-			if (elm->rxbuf[pos] == CAN327_DUMMY_CHAR) {
-				can327_send(elm, "\r", 1);
-				elm->state = CAN327_STATE_GETPROMPT;
-				pos++;
-				break;
-			} else if (can327_is_ready_char(elm->rxbuf[pos])) {
-				can327_send(elm, CAN327_DUMMY_STRING, 1);
-				pos++;
-				break;
-			}
-		}
+	memcpy(elm->rxline, &elm->rxbuf[start], first);
+	memcpy(&elm->rxline[first], elm->rxbuf, len + 1 - first);
 
-		can327_drop_bytes(elm, pos);
-		break;
+	return elm->rxline;
+}
+
+/* Parse up to budget lines from the RX buffer.
+ * Returns the number of lines (or other chunks of data) consumed.
+ */
+static int can327_parse_rxbuf(struct can327 *elm, int budget)
+{
+	const u8 *line;
+	unsigned int head;
+	unsigned int pos;
+	bool ready;
+	int done = 0;
+	int len;
 
-	case CAN327_STATE_GETPROMPT:
-		/* Wait for '>' */
-		if (can327_is_ready_char(elm->rxbuf[elm->rxfill - 1]))
-			can327_handle_prompt(elm);
+	lockdep_assert_held(&elm->lock);
 
-		elm->rxfill = 0;
-		break;
+	for (; done < budget && can327_rxfill(elm); done++) {
+		switch (elm->state) {
+		case CAN327_STATE_NOTINIT:
+			can327_drop_all_bytes(elm);
+			break;
 
-	case CAN327_STATE_RECEIVING:
-		/* Find <CR> delimiting feedback lines. */
-		len = first_new_char_idx;
-		while (len < elm->rxfill && elm->rxbuf[len] != '\r')
-			len++;
+		case CAN327_STATE_GETDUMMYCHAR:
+			/* Wait for 'y' or '>' */
+			head = can327_rxhead(elm);
+			for (pos = elm->rxtail; pos != head; pos++) {
+				u8 c = can327_rxbuf_at(elm, pos);
+
+				if (c == CAN327_DUMMY_CHAR) {
+					can327_send(elm, "\r", 1);
+					can327_set_state(elm, CAN327_STATE_GETPROMPT);
+					pos++;
+					break;
+				} else if (can327_is_ready_char(c)) {
+					can327_send(elm, CAN327_DUMMY_STRING, 1);
+					pos++;
+					break;
+				}
+			}
+
+			can327_drop_bytes(elm, pos - elm->rxtail);
+			break;
 
-		if (len == CAN327_SIZE_RXBUF) {
-			/* Assume the buffer ran full with garbage.
-			 * Did we even connect at the right baud rate?
+		case CAN327_STATE_GETPROMPT:
+			/* Wait for '>'
+			 *
+			 * Look at the last byte before dropping the bytes,
+			 * as the producer may reuse its slot after that.
 			 */
-			netdev_err(elm->dev,
-				   "RX buffer overflow. Faulty ELM327 or UART?\n");
-			can327_uart_side_failure(elm);
-		} else if (len == elm->rxfill) {
-			if (can327_is_ready_char(elm->rxbuf[elm->rxfill - 1])) {
-				/* The ELM327's AT ST response timeout ran out,
-				 * so we got a prompt.
-				 * Clear RX buffer and restart listening.
-				 */
-				elm->rxfill = 0;
+			head = can327_rxhead(elm);
+			ready = can327_is_ready_char(can327_rxbuf_at(elm, head - 1));
+			can327_drop_bytes(elm, head - elm->rxtail);
 
+			if (ready)
 				can327_handle_prompt(elm);
+			break;
+
+		case CAN327_STATE_BAUD_GETOK:
+		case CAN327_STATE_BAUD_GETID:
+			len = can327_find_line(elm);
+			if (len < 0) {
+				/* Garbage at the wrong baud rate. */
+				if (can327_rxfill(elm) == elm->rxbuf_size)
+					can327_drop_all_bytes(elm);
+
+				return done;
+			}
+
+			line = can327_line_view(elm, len);
+			can327_parse_baud_line(elm, line, len);
+			can327_drop_bytes(elm, len + 1);
+			break;
+
+		case CAN327_STATE_GETREPLY:
+			len = can327_find_line(elm);
+			if (len < 0) {
+				head = can327_rxhead(elm);
+				if (can327_is_ready_char(can327_rxbuf_at(elm, head - 1))) {
+					/* A prompt, but no reply. */
+					can327_handle_reply(elm, NULL, 0);
+					break;
+				}
+
+				return done;
+			}
+
+			line = can327_line_view(elm, len);
+			can327_parse_reply_line(elm, line, len);
+			can327_drop_bytes(elm, len + 1);
+			break;
+
+		case CAN327_STATE_RECEIVING:
+			/* Find <CR> delimiting feedback lines. */
+			len = can327_find_line(elm);
+			if (len < 0) {
+				head = can327_rxhead(elm);
+				if (head - elm->rxtail == elm->rxbuf_size) {
+					/* Assume the buffer ran full with garbage.
+					 * Did we even connect at the right baud rate?
+					 */
+					netdev_err(elm->dev,
+						   "RX buffer overflow. Faulty ELM327 or UART?\n");
+					can327_uart_side_failure(elm);
+				} else if (can327_is_ready_char(can327_rxbuf_at(elm, head - 1))) {
+					/* The ELM327's AT ST response timeout ran out,
+					 * so we got a prompt.
+					 * Clear RX buffer and restart listening.
+					 */
+					can327_drop_bytes(elm, head - elm->rxtail);
+
+					if (elm->reply_wait)
+						can327_reply_missed(elm);
+
+					can327_handle_prompt(elm);
+				}
+
+				/* No <CR> found - we haven't received a full line yet.
+				 * Wait for more data.
+				 */
+				return done;
 			}
 
-			/* No <CR> found - we haven't received a full line yet.
-			 * Wait for more data.
-			 */
-		} else {
 			/* We have a full line to parse. */
-			can327_parse_line(elm, len);
+			line = can327_line_view(elm, len);
+			elm->rxline_stamp = elm->rxstamps[(elm->rxtail + len) &
+							  (elm->rxbuf_size - 1)];
+			can327_parse_line(elm, line, len);
+			elm->perf.rx_lines++;
+			elm->rxline_stamp = 0;
 
 			/* Remove parsed data from RX buffer. */
 			can327_drop_bytes(elm, len + 1);
-
-			/* More data to parse? */
-			if (elm->rxfill)
-				can327_parse_rxbuf(elm, 0);
+			break;
 		}
+
+		if (elm->uart_side_failure)
+			return done;
 	}
+
+	return done;
+}
+
+/* Parse up to budget lines from the RX ring buffer.
+ *
+ * This is a NAPI instance of our own, separate from rx-offload's:
+ * can_rx_offload's poll only drains its skb queue, and has no hook
+ * to produce frames from within it. Besides, error frames are also
+ * queued from can327_err_worker() and on bus-off, and rx-offload
+ * sorts them in with the received ones by timestamp. So the frames
+ * parsed here are queued there, and delivered from its NAPI.
+ *
+ * The second NAPI is scheduled from softirq context, so it usually
+ * runs in the same softirq pass as this one rather than waiting for
+ * another interrupt.
+ */
+static int can327_rx_poll(struct napi_struct *napi, int budget)
+{
+	struct can327 *elm = container_of(napi, struct can327, rx_napi);
+	int done;
+
+	spin_lock_bh(&elm->lock);
+	done = can327_parse_rxbuf(elm, budget);
+	can327_flush_rx_batch(elm);
+	spin_unlock_bh(&elm->lock);
+
+	/* Send whatever the replies have made us say */
+	can327_tx_flush(elm);
+
+	if (done < budget)
+		napi_complete_done(napi, done);
+
+	return done;
 }
 
 #if LINUX_VERSION_CODE < KERNEL_VERSION(5,10,0)
@@ -781,9 +3142,32 @@ static struct sk_buff *can327_mailbox_read(struct can_rx_offload *offload,
 #endif
 #endif
 
+/* NAPI weight for rx-offload, so that a typical chunk's worth of
+ * frames is delivered in a single poll. NAPI doesn't expect the weight
+ * to change once added, so this is based on the chunks seen since the
+ * line discipline was attached, and only picked up when the netdev is
+ * opened. Until then, allow the largest chunks.
+ */
+static unsigned int can327_rx_weight(struct can327 *elm)
+{
+	unsigned long avg;
+
+	if (napi_weight)
+		return clamp_t(unsigned int, napi_weight,
+			       CAN327_NAPI_WEIGHT, NAPI_POLL_WEIGHT);
+
+	avg = ewma_can327_batch_read(&elm->rx_batch_avg);
+	if (!avg)
+		return NAPI_POLL_WEIGHT;
+
+	return clamp_t(unsigned int, avg,
+		       CAN327_NAPI_WEIGHT, NAPI_POLL_WEIGHT);
+}
+
 static int can327_netdev_open(struct net_device *dev)
 {
 	struct can327 *elm = netdev_priv(dev);
+	unsigned int weight;
 	int err;
 
 	spin_lock_bh(&elm->lock);
@@ -798,8 +3182,21 @@ static int can327_netdev_open(struct net_device *dev)
 			    "Reopening netdev after a UART side fault has been detected.\n");
 
 	/* Clear TTY buffers */
-	elm->rxfill = 0;
+	can327_drop_all_bytes(elm);
+	spin_lock(&elm->tx_lock);
+	elm->txhead = elm->txbuf;
 	elm->txleft = 0;
+	spin_unlock(&elm->tx_lock);
+
+	/* Drop any frames left over from a previous session.
+	 * close_candev() has freed their echo skbs.
+	 */
+	kfifo_reset(&elm->tx_fifo);
+	elm->tx_sched_len = 0;
+	elm->tx_sched_skips = 0;
+	elm->echo_used = 0;
+	elm->tx_echo_pending = false;
+	netdev_reset_queue(dev);
 
 	/* open_candev() checks for elm->can.bittiming.bitrate != 0 */
 	err = open_candev(dev);
@@ -808,15 +3205,23 @@ static int can327_netdev_open(struct net_device *dev)
 		return err;
 	}
 
+	elm->rx_batch = 0;
+	weight = can327_rx_weight(elm);
+
 	can327_init_device(elm);
 	spin_unlock_bh(&elm->lock);
 
+	can327_tx_flush(elm);
+
+	/* Have skbs ready for the first frames */
+	schedule_work(&elm->rx_pool_work);
+
 #if LINUX_VERSION_CODE < KERNEL_VERSION(5,10,0)
 	elm->offload.mailbox_read = can327_mailbox_read;
-	err = can_rx_offload_add_fifo(dev, &elm->offload, CAN327_NAPI_WEIGHT);
+	err = can_rx_offload_add_fifo(dev, &elm->offload, weight);
 #else
 	/* Fixed in v5.10 - 728fc9ff73d3 */
-	err = can_rx_offload_add_manual(dev, &elm->offload, CAN327_NAPI_WEIGHT);
+	err = can_rx_offload_add_manual(dev, &elm->offload, weight);
 #endif
 	if (err) {
 		close_candev(dev);
@@ -824,6 +3229,10 @@ static int can327_netdev_open(struct net_device *dev)
 	}
 
 	can_rx_offload_enable(&elm->offload);
+	napi_enable(&elm->rx_napi);
+
+	/* Catch up on the ELM327's first replies. */
+	napi_schedule(&elm->rx_napi);
 
 	elm->can.state = CAN_STATE_ERROR_ACTIVE;
 	netif_start_queue(dev);
@@ -840,12 +3249,26 @@ static int can327_netdev_close(struct net_device *dev)
 	can327_send(elm, CAN327_DUMMY_STRING, 1);
 	spin_unlock_bh(&elm->lock);
 
+	can327_tx_flush(elm);
+
 	netif_stop_queue(dev);
 
 	/* Give UART one final chance to flush. */
 	clear_bit(TTY_DO_WRITE_WAKEUP, &elm->tty->flags);
 	flush_work(&elm->tx_work);
 
+	/* Abort any baud rate switch in progress */
+	cancel_delayed_work_sync(&elm->baud_timeout_work);
+	flush_work(&elm->baud_work);
+
+	/* Don't report errors from before the next open */
+	cancel_delayed_work_sync(&elm->err_work);
+	spin_lock_bh(&elm->lock);
+	elm->err_pending = 0;
+	memset(&elm->err_frame, 0, sizeof(elm->err_frame));
+	spin_unlock_bh(&elm->lock);
+
+	napi_disable(&elm->rx_napi);
 	can_rx_offload_disable(&elm->offload);
 	elm->can.state = CAN_STATE_STOPPED;
 	can_rx_offload_del(&elm->offload);
@@ -854,12 +3277,91 @@ static int can327_netdev_close(struct net_device *dev)
 	return 0;
 }
 
+/* Send a frame through a TX peer, so we can keep monitoring.
+ * Like the bonding driver, we hand it to the peer's qdisc, and it's
+ * the peer's queue that pushes back.
+ */
+static void can327_bond_xmit(struct can327 *elm,
+			     const struct can327_bond *bond,
+			     struct sk_buff *skb)
+{
+	struct can_frame *frame = (struct can_frame *)skb->data;
+	struct can327 *peer = NULL;
+	struct can327_bond_echo *echo;
+	struct sk_buff *loopback = NULL;
+	u8 len = frame->can_id & CAN_RTR_FLAG ? 0 : frame->len;
+	unsigned int first;
+	unsigned int i;
+	int err;
+
+	/* Frames with the same CAN ID go through the same peer, and so
+	 * stay in order - unless it's down, then the next one takes over.
+	 */
+	first = (frame->can_id & CAN_EFF_MASK) % bond->count;
+	for (i = 0; i < bond->count; i++) {
+		peer = bond->peers[(first + i) % bond->count];
+		if (netif_running(peer->dev))
+			break;
+	}
+
+	if (i == bond->count) {
+		elm->dev->stats.tx_dropped++;
+		kfree_skb(skb);
+		return;
+	}
+
+	/* Note the frame before it can come back from the bus. */
+	spin_lock(&elm->lock);
+	echo = &elm->bond_echoes[elm->next_bond_echo];
+	elm->next_bond_echo = (elm->next_bond_echo + 1) %
+			      CAN327_SIZE_BOND_ECHOES;
+	echo->frame = *frame;
+	echo->sent = ktime_get();
+	spin_unlock(&elm->lock);
+
+	/* With IFF_ECHO, echoing our frames to local sockets is up to us,
+	 * and the peer only echoes to those on its own netdev. Do it now,
+	 * as if the frame had been sent - unless the socket asked not to
+	 * get it back, like can_put_echo_skb() does.
+	 */
+	if (skb->pkt_type == PACKET_LOOPBACK)
+		loopback = skb_clone(skb, GFP_ATOMIC);
+	if (loopback) {
+		can_skb_set_owner(loopback, skb->sk);
+		loopback->dev = elm->dev;
+		loopback->pkt_type = PACKET_LOOPBACK;
+		loopback->ip_summed = CHECKSUM_UNNECESSARY;
+	}
+
+	/* NET_XMIT_CN means the frame was queued, but others may be
+	 * dropped. See net_xmit_eval().
+	 */
+	skb->dev = peer->dev;
+	err = dev_queue_xmit(skb);
+	if (!net_xmit_eval(err)) {
+		elm->dev->stats.tx_packets++;
+		elm->dev->stats.tx_bytes += len;
+		if (loopback)
+			netif_rx(loopback);
+	} else {
+		elm->dev->stats.tx_dropped++;
+		kfree_skb(loopback);
+
+		/* Don't let it swallow a genuine frame on the bus. */
+		spin_lock(&elm->lock);
+		echo->sent = 0;
+		spin_unlock(&elm->lock);
+	}
+}
+
 /* Send a can_frame to a TTY. */
 static netdev_tx_t can327_netdev_start_xmit(struct sk_buff *skb,
 					    struct net_device *dev)
 {
 	struct can327 *elm = netdev_priv(dev);
 	struct can_frame *frame = (struct can_frame *)skb->data;
+	struct can327_bond *bond;
+	struct can327_tx_frame entry;
 
 	if (can_dropped_invalid_skb(dev, skb))
 		return NETDEV_TX_OK;
@@ -878,17 +3380,73 @@ static netdev_tx_t can327_netdev_start_xmit(struct sk_buff *skb,
 		goto out;
 	}
 
-	netif_stop_queue(dev);
+	/* The core holds rcu_read_lock_bh() around us */
+	bond = rcu_dereference_bh(elm->bond);
+	if (bond) {
+		can327_bond_xmit(elm, bond, skb);
+		return NETDEV_TX_OK;
+	}
 
-	/* BHs are already disabled, so no spin_lock_bh().
-	 * See Documentation/networking/netdevices.txt
+	/* We are the only writer to the FIFO, and the state machine is
+	 * the only reader, so no locking is needed.
+	 *
+	 * The queue is stopped whenever the FIFO is full,
+	 * so there is always room for this frame, and an echo skb.
 	 */
-	spin_lock(&elm->lock);
-	can327_send_frame(elm, frame);
-	spin_unlock(&elm->lock);
+	entry.frame = *frame;
+	entry.queued = ktime_get();
 
-	dev->stats.tx_packets++;
-	dev->stats.tx_bytes += frame->can_id & CAN_RTR_FLAG ? 0 : frame->len;
+	/* Take a free echo slot. test_and_set_bit_lock() pairs with
+	 * clear_bit_unlock() in can327_tx_complete(): Once we own the
+	 * slot, the previous echo skb in it is gone for sure.
+	 */
+	do {
+		entry.echo = find_first_zero_bit(&elm->echo_used,
+						 CAN327_SIZE_ECHO);
+		if (WARN_ON_ONCE(entry.echo >= CAN327_SIZE_ECHO))
+			goto out;
+	} while (test_and_set_bit_lock(entry.echo, &elm->echo_used));
+
+	/* The skb is the echo's from here on.
+	 * can327_tx_complete() gives it back once the frame is sent.
+	 */
+	netdev_sent_queue(dev, can327_tx_cost(&entry.frame));
+	can327_put_echo_skb(skb, dev, entry.echo);
+
+	WARN_ON_ONCE(!kfifo_put(&elm->tx_fifo, entry));
+
+	if (kfifo_is_full(&elm->tx_fifo)) {
+		netif_stop_queue(dev);
+
+		/* The state machine may have taken a frame and woken the
+		 * queue before we stopped it. Check again.
+		 */
+		smp_mb();
+		if (!kfifo_is_full(&elm->tx_fifo))
+			netif_wake_queue(dev);
+	}
+
+	/* If we're in monitor mode, go fetch a prompt so the frame can be
+	 * sent. Otherwise, the state machine is on its way to the prompt
+	 * already, and can327_handle_prompt() will dequeue the frame.
+	 *
+	 * Pairs with smp_mb() in can327_handle_prompt(): Either we see
+	 * it entering monitor mode, or it sees our frame in the FIFO.
+	 */
+	smp_mb();
+	if (READ_ONCE(elm->state) == CAN327_STATE_RECEIVING) {
+		/* BHs are already disabled, so no spin_lock_bh().
+		 * See Documentation/networking/netdevices.txt
+		 */
+		spin_lock(&elm->lock);
+		if (elm->state == CAN327_STATE_RECEIVING)
+			can327_kick_into_cmd_mode(elm);
+		spin_unlock(&elm->lock);
+
+		can327_tx_flush(elm);
+	}
+
+	return NETDEV_TX_OK;
 
 out:
 	kfree_skb(skb);
@@ -904,30 +3462,163 @@ static const struct net_device_ops can327_netdev_ops = {
 
 static bool can327_is_valid_rx_char(u8 c)
 {
-	static const bool lut_char_is_valid['z'] = {
-		['\r'] = true,
-		[' '] = true,
-		['.'] = true,
-		['0'] = true, true, true, true, true,
-		['5'] = true, true, true, true, true,
-		['<'] = true,
-		[CAN327_READY_CHAR] = true,
-		['?'] = true,
-		['A'] = true, true, true, true, true, true, true,
-		['H'] = true, true, true, true, true, true, true,
-		['O'] = true, true, true, true, true, true, true,
-		['V'] = true, true, true, true, true,
-		['a'] = true,
-		['b'] = true,
-		['v'] = true,
-		[CAN327_DUMMY_CHAR] = true,
-	};
-	BUILD_BUG_ON(CAN327_DUMMY_CHAR >= 'z');
+	return can327_char_class[c] & CAN327_CC_VALID;
+}
+
+/* Producer side view of the free space in the RX buffer */
+static inline unsigned int can327_rx_room(const struct can327 *elm)
+{
+	return elm->rxbuf_size - (elm->rxhead - smp_load_acquire(&elm->rxtail));
+}
+
+/* Make bytes up to head visible to the parser. */
+static inline void can327_rx_publish(struct can327 *elm, unsigned int head)
+{
+	/* Pairs with smp_load_acquire() in can327_rxhead(). */
+	smp_store_release(&elm->rxhead, head);
+}
+
+/* Write a byte to the RX buffer at pos, which isn't visible to the
+ * parser yet. now is when the last byte of the current chunk arrived,
+ * left is the number of bytes after this one in the chunk.
+ */
+static inline void can327_rx_put(struct can327 *elm, unsigned int pos,
+				 u8 c, ktime_t now, unsigned int left)
+{
+	pos &= elm->rxbuf_size - 1;
+
+	elm->rxbuf[pos] = c;
+	__assign_bit(pos, elm->rxcrmap, c == '\r');
+	if (c == '\r')
+		elm->rxstamps[pos] =
+			ktime_sub_ns(now, (u64)left * READ_ONCE(elm->rx_byte_ns));
+}
+
+/* Copy as much of cp[] as fits into the RX buffer in bulk, checking
+ * the characters and noting the <CR>s while at it.
+ *
+ * Returns the number of bytes taken, or 0 if the data contains NULs or
+ * illegal characters. Those are left to can327_rx_slow().
+ */
+static unsigned int can327_rx_fast(struct can327 *elm, const u8 *cp,
+				   unsigned int count, ktime_t now)
+{
+	unsigned int n = min(count, can327_rx_room(elm));
+	u32 byte_ns = READ_ONCE(elm->rx_byte_ns);
+	unsigned int done;
+	unsigned int start;
+	unsigned int chunk;
+	unsigned int i;
+	u8 valid = CAN327_CC_VALID;
+
+	for (done = 0; done < n; done += chunk) {
+		start = (elm->rxhead + done) & (elm->rxbuf_size - 1);
+		chunk = min(n - done, elm->rxbuf_size - start);
+
+		memcpy(&elm->rxbuf[start], &cp[done], chunk);
+		bitmap_clear(elm->rxcrmap, start, chunk);
+
+		for (i = 0; i < chunk; i++) {
+			valid &= can327_char_class[cp[done + i]];
+			if (cp[done + i] == '\r') {
+				__set_bit(start + i, elm->rxcrmap);
+				elm->rxstamps[start + i] =
+					ktime_sub_ns(now, (u64)(count - 1 - done - i) *
+						     byte_ns);
+			}
+		}
+	}
+
+	if (!valid)
+		return 0;
+
+	can327_rx_publish(elm, elm->rxhead + n);
+
+	return n;
+}
+
+/* Take bytes into the RX buffer one by one, dropping NULs and
+ * handling characters flagged by the TTY or not expected from the
+ * ELM327.
+ *
+ * Returns the number of bytes taken, or -EIO on a UART side failure.
+ */
+static int can327_rx_slow(struct can327 *elm, const u8 *cp, const char *fp,
+			  unsigned int count, ktime_t now)
+{
+	unsigned int head = elm->rxhead;
+	unsigned int room = can327_rx_room(elm);
+	enum can327_state state = READ_ONCE(elm->state);
+	bool failed = false;
+	unsigned int i;
+
+	for (i = 0; i < count && head - elm->rxhead < room; i++) {
+		/* Expect garbage while switching baud rates.
+		 * The parser may not have seen the ELM327's OK yet, so this
+		 * includes the state before it.
+		 */
+		if ((state == CAN327_STATE_BAUD_GETOK ||
+		     state == CAN327_STATE_BAUD_GETID) &&
+		    ((fp && fp[i]) || !can327_is_valid_rx_char(cp[i])))
+			continue;
+
+		if (fp && fp[i]) {
+			failed = true;
+			break;
+		}
+
+		/* Ignore NUL characters, which the PIC microcontroller may
+		 * inadvertently insert due to a known hardware bug.
+		 * See ELM327 documentation, which refers to a Microchip PIC
+		 * bug description.
+		 */
+		if (!cp[i])
+			continue;
+
+		/* Replies to ATI, STI and AT@1 are free text, which
+		 * clones fill with all sorts of punctuation.
+		 */
+		if (state == CAN327_STATE_GETREPLY && isprint(cp[i])) {
+			can327_rx_put(elm, head++, cp[i], now, count - 1 - i);
+			continue;
+		}
+
+		/* Check for stray characters on the UART line.
+		 * Likely caused by bad hardware.
+		 */
+		if (!can327_is_valid_rx_char(cp[i])) {
+			failed = true;
+			break;
+		}
 
-	return (c < ARRAY_SIZE(lut_char_is_valid) && lut_char_is_valid[c]);
+		can327_rx_put(elm, head++, cp[i], now, count - 1 - i);
+	}
+
+	can327_rx_publish(elm, head);
+
+	if (failed) {
+		spin_lock_bh(&elm->lock);
+		if (fp && fp[i])
+			netdev_err(elm->dev,
+				   "Error in received character stream. Check your wiring.");
+		else
+			netdev_err(elm->dev,
+				   "Received illegal character %02x.\n",
+				   cp[i]);
+		can327_uart_side_failure(elm);
+		spin_unlock_bh(&elm->lock);
+
+		return -EIO;
+	}
+
+	return i;
 }
 
 /* Handle incoming ELM327 ASCII data.
+ * This only copies the data to the RX buffer, which is parsed in
+ * can327_rx_poll() - unless it's been filled up, in which case we
+ * parse right here to make room.
+ *
  * This will not be re-entered while running, but other ldisc
  * functions may be called in parallel.
  */
@@ -940,135 +3631,437 @@ static void can327_ldisc_rx(struct tty_struct *tty,
 #endif
 {
 	struct can327 *elm = (struct can327 *)tty->disc_data;
-	size_t first_new_char_idx;
+	ktime_t now = ktime_get_real();
+	bool full;
+	int taken;
+
+	if (elm->uart_side_failure)
+		return;
+
+	elm->perf.rx_bytes += count;
+	elm->perf.rx_busy_ns += (u64)count * READ_ONCE(elm->rx_byte_ns);
+
+	/* Usually, no character has an error flag. */
+	if (fp && !memchr_inv(fp, 0, count))
+		fp = NULL;
+
+	trace_can327_rx_chunk(elm->dev, count, fp);
+
+	while (count) {
+		taken = 0;
+		if (!fp)
+			taken = can327_rx_fast(elm, cp, count, now);
+		if (!taken)
+			taken = can327_rx_slow(elm, cp, fp, count, now);
+		if (taken < 0)
+			return;
+
+		cp += taken;
+		if (fp)
+			fp += taken;
+		count -= taken;
+
+		if (!count)
+			break;
+
+		/* NAPI isn't keeping up. Parse what we have, making room
+		 * for the rest. Leaving the bytes to the TTY layer would
+		 * only move the overflow there, as the ELM327 can't be
+		 * told to pause sending.
+		 */
+		spin_lock_bh(&elm->lock);
+		can327_parse_rxbuf(elm, INT_MAX);
+		can327_flush_rx_batch(elm);
+
+		full = can327_rxfill(elm) == elm->rxbuf_size;
+		if (full && !elm->uart_side_failure) {
+			netdev_err(elm->dev,
+				   "Receive buffer overflowed. Bad chip or wiring? count = %i",
+				   count);
+
+			can327_uart_side_failure(elm);
+		}
+		spin_unlock_bh(&elm->lock);
+
+		if (elm->uart_side_failure)
+			return;
+
+		can327_tx_flush(elm);
+	}
+
+	napi_schedule(&elm->rx_napi);
+}
+
+/* Write out remaining transmit buffer.
+ * Scheduled when TTY is writable.
+ */
+static void can327_ldisc_tx_worker(struct work_struct *work)
+{
+	struct can327 *elm = container_of(work, struct can327, tx_work);
 
 	if (elm->uart_side_failure)
 		return;
 
+	can327_tx_flush(elm);
+}
+
+/* Called by the driver when there's room for more data.
+ *
+ * Many TTY drivers call this with their own locks held, so we can't
+ * usually write from here. If the user tells us it's safe, we try
+ * anyway, unless we're in the middle of writing already.
+ */
+static void can327_ldisc_tx_wakeup(struct tty_struct *tty)
+{
+	struct can327 *elm = (struct can327 *)tty->disc_data;
+	ssize_t written;
+
+	/* spin_unlock_bh() must not run with IRQs off, and some TTY
+	 * drivers call us from their IRQ handler or under their own
+	 * spin_lock_irqsave(). Leave these cases to the worker.
+	 */
+	if (tx_direct && !in_hardirq() && !irqs_disabled() &&
+	    spin_trylock_bh(&elm->tx_lock)) {
+		written = can327_tx_write(elm);
+		spin_unlock_bh(&elm->tx_lock);
+
+		/* Leave reporting errors to the worker */
+		if (written >= 0)
+			return;
+	}
+
+	queue_work(can327_wq, &elm->tx_work);
+}
+
+/* ELM327 can only handle bitrates that are integer divisors of 500 kHz,
+ * or 7/8 of that. Divisors are 1 to 64.
+ * Currently we don't implement support for 7/8 rates.
+ */
+static const u32 can327_bitrate_const[] = {
+	7812,  7936,  8064,  8196,   8333,   8474,   8620,   8771,
+	8928,  9090,  9259,  9433,   9615,   9803,   10000,  10204,
+	10416, 10638, 10869, 11111,  11363,  11627,  11904,  12195,
+	12500, 12820, 13157, 13513,  13888,  14285,  14705,  15151,
+	15625, 16129, 16666, 17241,  17857,  18518,  19230,  20000,
+	20833, 21739, 22727, 23809,  25000,  26315,  27777,  29411,
+	31250, 33333, 35714, 38461,  41666,  45454,  50000,  55555,
+	62500, 71428, 83333, 100000, 125000, 166666, 250000, 500000
+};
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6,0,0)
+/* Dummy needed to use bitrate_const
+ * Fixed in v6.0 - 7e193a42c37c
+ */
+static int can327_do_set_bittiming(struct net_device *netdev)
+{
+	return 0;
+}
+#endif
+
+/* Performance counters, as shown by ethtool -S and in debugfs */
+static const char * const can327_perf_names[] = {
+	"cmd_mode_kicks",
+	"monitor_starts",
+	"prompts",
+	"tx_prompts",
+	"tx_frames",
+	"tx_prompts_per_frame_x100",
+	"rx_frames",
+	"rx_uart_bytes",
+	"rx_uart_bytes_per_frame_x100",
+	"rx_lines",
+	"tx_uart_bytes",
+	"uart_rx_util_permille",
+	"uart_tx_util_permille",
+	"cmds_skipped",
+	"errors_coalesced",
+};
+
+#define CAN327_NUM_PERF_STATS (ARRAY_SIZE(can327_perf_names) + \
+			       CAN327_NUM_ERRS + CAN327_NUM_STATES + \
+			       2 * CAN327_HIST_BUCKETS)
+
+static void can327_get_hist_strings(u8 **data, const char *prefix)
+{
+	unsigned int i;
+
+	for (i = 0; i < CAN327_HIST_BUCKETS - 1; i++) {
+		snprintf(*data, ETH_GSTRING_LEN, "%s_lt_%uus", prefix,
+			 CAN327_HIST_MIN_US << i);
+		*data += ETH_GSTRING_LEN;
+	}
+
+	snprintf(*data, ETH_GSTRING_LEN, "%s_ge_%uus", prefix,
+		 CAN327_HIST_MIN_US << (CAN327_HIST_BUCKETS - 2));
+	*data += ETH_GSTRING_LEN;
+}
+
+static void can327_get_perf_strings(u8 *data)
+{
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(can327_perf_names); i++) {
+		strscpy(data, can327_perf_names[i], ETH_GSTRING_LEN);
+		data += ETH_GSTRING_LEN;
+	}
+
+	for (i = 0; i < CAN327_NUM_ERRS; i++) {
+		snprintf(data, ETH_GSTRING_LEN, "err_%s", can327_errs[i].name);
+		data += ETH_GSTRING_LEN;
+	}
+
+	for (i = 0; i < CAN327_NUM_STATES; i++) {
+		snprintf(data, ETH_GSTRING_LEN, "state_%s_ms",
+			 can327_state_names[i]);
+		data += ETH_GSTRING_LEN;
+	}
+
+	can327_get_hist_strings(&data, "tx_latency");
+	can327_get_hist_strings(&data, "rx_latency");
+}
+
+static u64 can327_ratio(u64 num, u64 den, u64 scale)
+{
+	return den ? div64_u64(num * scale, den) : 0;
+}
+
+static void can327_get_perf_stats(struct can327 *elm, u64 *data)
+{
+	struct can327_perf *perf = &elm->perf;
+	ktime_t now = ktime_get();
+	u64 elapsed;
+	unsigned int i;
+
 	spin_lock_bh(&elm->lock);
 
-	/* Store old rxfill, so can327_parse_rxbuf() will have
-	 * the option of skipping already checked characters.
-	 */
-	first_new_char_idx = elm->rxfill;
+	elapsed = ktime_to_ns(ktime_sub(now, perf->since));
+
+	*data++ = perf->kicks;
+	*data++ = perf->monitor_starts;
+	*data++ = perf->prompts;
+	*data++ = perf->tx_prompts;
+	*data++ = perf->tx_frames;
+	*data++ = can327_ratio(perf->tx_prompts, perf->tx_frames, 100);
+	*data++ = perf->rx_frames;
+	*data++ = perf->rx_bytes;
+	*data++ = can327_ratio(perf->rx_bytes, perf->rx_frames, 100);
+	*data++ = perf->rx_lines;
+	*data++ = perf->tx_bytes;
+	*data++ = can327_ratio(perf->rx_busy_ns, elapsed, 1000);
+	*data++ = can327_ratio(perf->tx_busy_ns, elapsed, 1000);
+	*data++ = elm->cmds_skipped;
+	*data++ = elm->errors_coalesced;
+
+	for (i = 0; i < CAN327_NUM_ERRS; i++)
+		*data++ = elm->errors[i];
+
+	/* Include the time in the current state so far */
+	for (i = 0; i < CAN327_NUM_STATES; i++) {
+		u64 ns = perf->state_ns[i];
+
+		if (i == elm->state)
+			ns += ktime_to_ns(ktime_sub(now, perf->state_since));
+
+		*data++ = div_u64(ns, NSEC_PER_MSEC);
+	}
+
+	for (i = 0; i < CAN327_HIST_BUCKETS; i++)
+		*data++ = perf->tx_latency[i];
+	for (i = 0; i < CAN327_HIST_BUCKETS; i++)
+		*data++ = perf->rx_latency[i];
+
+	spin_unlock_bh(&elm->lock);
+}
+
+static int can327_get_sset_count(struct net_device *dev, int sset)
+{
+	switch (sset) {
+	case ETH_SS_STATS:
+		return CAN327_NUM_PERF_STATS;
+	default:
+		return -EOPNOTSUPP;
+	}
+}
+
+static void can327_get_strings(struct net_device *dev, u32 sset, u8 *data)
+{
+	if (sset == ETH_SS_STATS)
+		can327_get_perf_strings(data);
+}
+
+static void can327_get_ethtool_stats(struct net_device *dev,
+				     struct ethtool_stats *stats, u64 *data)
+{
+	can327_get_perf_stats(netdev_priv(dev), data);
+}
+
+static const struct ethtool_ops can327_ethtool_ops = {
+	.get_sset_count = can327_get_sset_count,
+	.get_strings = can327_get_strings,
+	.get_ethtool_stats = can327_get_ethtool_stats,
+};
+
+/* Shared by all channels, each having a directory named after its TTY */
+static struct dentry *can327_debugfs;
 
-	while (count-- && elm->rxfill < CAN327_SIZE_RXBUF) {
-		if (fp && *fp++) {
-			netdev_err(elm->dev,
-				   "Error in received character stream. Check your wiring.");
+static int can327_debugfs_stats_show(struct seq_file *m, void *v)
+{
+	struct can327 *elm = m->private;
+	u64 *values;
+	u8 *names;
+	unsigned int i;
+
+	names = kcalloc(CAN327_NUM_PERF_STATS, ETH_GSTRING_LEN, GFP_KERNEL);
+	values = kcalloc(CAN327_NUM_PERF_STATS, sizeof(*values), GFP_KERNEL);
+	if (!names || !values) {
+		kfree(names);
+		kfree(values);
+		return -ENOMEM;
+	}
 
-			can327_uart_side_failure(elm);
+	can327_get_perf_strings(names);
+	can327_get_perf_stats(elm, values);
 
-			spin_unlock_bh(&elm->lock);
-			return;
-		}
+	for (i = 0; i < CAN327_NUM_PERF_STATS; i++)
+		seq_printf(m, "%.*s: %llu\n", ETH_GSTRING_LEN,
+			   &names[i * ETH_GSTRING_LEN], values[i]);
 
-		/* Ignore NUL characters, which the PIC microcontroller may
-		 * inadvertently insert due to a known hardware bug.
-		 * See ELM327 documentation, which refers to a Microchip PIC
-		 * bug description.
-		 */
-		if (*cp) {
-			/* Check for stray characters on the UART line.
-			 * Likely caused by bad hardware.
-			 */
-			if (!can327_is_valid_rx_char(*cp)) {
-				netdev_err(elm->dev,
-					   "Received illegal character %02x.\n",
-					   *cp);
-				can327_uart_side_failure(elm);
-
-				spin_unlock_bh(&elm->lock);
-				return;
-			}
+	kfree(names);
+	kfree(values);
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(can327_debugfs_stats);
 
-			elm->rxbuf[elm->rxfill++] = *cp;
-		}
+static ssize_t tx_canid_switches_saved_show(struct device *dev,
+					    struct device_attribute *attr,
+					    char *buf)
+{
+	struct can327 *elm = netdev_priv(to_net_dev(dev));
 
-		cp++;
-	}
+	return sysfs_emit(buf, "%lu\n", elm->tx_canid_switches_saved);
+}
+static DEVICE_ATTR_RO(tx_canid_switches_saved);
 
-	if (count >= 0) {
-		netdev_err(elm->dev,
-			   "Receive buffer overflowed. Bad chip or wiring? count = %i",
-			   count);
+static ssize_t tx_config_switches_saved_show(struct device *dev,
+					     struct device_attribute *attr,
+					     char *buf)
+{
+	struct can327 *elm = netdev_priv(to_net_dev(dev));
 
-		can327_uart_side_failure(elm);
+	return sysfs_emit(buf, "%lu\n", elm->tx_config_switches_saved);
+}
+static DEVICE_ATTR_RO(tx_config_switches_saved);
 
-		spin_unlock_bh(&elm->lock);
-		return;
-	}
+static ssize_t tx_deadlines_missed_show(struct device *dev,
+					struct device_attribute *attr,
+					char *buf)
+{
+	struct can327 *elm = netdev_priv(to_net_dev(dev));
 
-	can327_parse_rxbuf(elm, first_new_char_idx);
-	spin_unlock_bh(&elm->lock);
+	return sysfs_emit(buf, "%lu\n", elm->tx_deadlines_missed);
 }
+static DEVICE_ATTR_RO(tx_deadlines_missed);
 
-/* Write out remaining transmit buffer.
- * Scheduled when TTY is writable.
- */
-static void can327_ldisc_tx_worker(struct work_struct *work)
+static ssize_t cmds_skipped_show(struct device *dev,
+				 struct device_attribute *attr, char *buf)
 {
-	struct can327 *elm = container_of(work, struct can327, tx_work);
-	ssize_t written;
+	struct can327 *elm = netdev_priv(to_net_dev(dev));
 
-	if (elm->uart_side_failure)
-		return;
+	return sysfs_emit(buf, "%lu\n", elm->cmds_skipped);
+}
+static DEVICE_ATTR_RO(cmds_skipped);
 
-	spin_lock_bh(&elm->lock);
+static ssize_t errors_coalesced_show(struct device *dev,
+				     struct device_attribute *attr, char *buf)
+{
+	struct can327 *elm = netdev_priv(to_net_dev(dev));
 
-	if (elm->txleft) {
-		written = elm->tty->ops->write(elm->tty, elm->txhead,
-					       elm->txleft);
-		if (written < 0) {
-			netdev_err(elm->dev, "Failed to write to tty %s.\n",
-				   elm->tty->name);
-			can327_uart_side_failure(elm);
+	return sysfs_emit(buf, "%lu\n", elm->errors_coalesced);
+}
+static DEVICE_ATTR_RO(errors_coalesced);
 
-			spin_unlock_bh(&elm->lock);
-			return;
-		}
+static ssize_t bond_echoes_suppressed_show(struct device *dev,
+					   struct device_attribute *attr,
+					   char *buf)
+{
+	struct can327 *elm = netdev_priv(to_net_dev(dev));
 
-		elm->txleft -= written;
-		elm->txhead += written;
-	}
+	return sysfs_emit(buf, "%lu\n", elm->bond_echoes_suppressed);
+}
+static DEVICE_ATTR_RO(bond_echoes_suppressed);
 
-	if (!elm->txleft)
-		clear_bit(TTY_DO_WRITE_WAKEUP, &elm->tty->flags);
+static ssize_t caps_show(struct device *dev,
+			 struct device_attribute *attr, char *buf)
+{
+	struct can327 *elm = netdev_priv(to_net_dev(dev));
 
-	spin_unlock_bh(&elm->lock);
+	return sysfs_emit(buf, "0x%lx\n", READ_ONCE(elm->caps));
 }
+static DEVICE_ATTR_RO(caps);
 
-/* Called by the driver when there's room for more data. */
-static void can327_ldisc_tx_wakeup(struct tty_struct *tty)
+static ssize_t chip_id_show(struct device *dev,
+			    struct device_attribute *attr, char *buf)
 {
-	struct can327 *elm = (struct can327 *)tty->disc_data;
+	struct can327 *elm = netdev_priv(to_net_dev(dev));
+	ssize_t ret;
+
+	spin_lock_bh(&elm->lock);
+	ret = sysfs_emit(buf, "%s\n", elm->chip_id);
+	spin_unlock_bh(&elm->lock);
 
-	schedule_work(&elm->tx_work);
+	return ret;
 }
+static DEVICE_ATTR_RO(chip_id);
+
+static struct attribute *can327_sysfs_attrs[] = {
+	&dev_attr_tx_canid_switches_saved.attr,
+	&dev_attr_tx_config_switches_saved.attr,
+	&dev_attr_tx_deadlines_missed.attr,
+	&dev_attr_cmds_skipped.attr,
+	&dev_attr_errors_coalesced.attr,
+	&dev_attr_bond_echoes_suppressed.attr,
+	&dev_attr_caps.attr,
+	&dev_attr_chip_id.attr,
+	NULL
+};
 
-/* ELM327 can only handle bitrates that are integer divisors of 500 kHz,
- * or 7/8 of that. Divisors are 1 to 64.
- * Currently we don't implement support for 7/8 rates.
- */
-static const u32 can327_bitrate_const[] = {
-	7812,  7936,  8064,  8196,   8333,   8474,   8620,   8771,
-	8928,  9090,  9259,  9433,   9615,   9803,   10000,  10204,
-	10416, 10638, 10869, 11111,  11363,  11627,  11904,  12195,
-	12500, 12820, 13157, 13513,  13888,  14285,  14705,  15151,
-	15625, 16129, 16666, 17241,  17857,  18518,  19230,  20000,
-	20833, 21739, 22727, 23809,  25000,  26315,  27777,  29411,
-	31250, 33333, 35714, 38461,  41666,  45454,  50000,  55555,
-	62500, 71428, 83333, 100000, 125000, 166666, 250000, 500000
+static const struct attribute_group can327_sysfs_group = {
+	.name = "can327",
+	.attrs = can327_sysfs_attrs,
 };
 
-#if LINUX_VERSION_CODE < KERNEL_VERSION(6,0,0)
-/* Dummy needed to use bitrate_const
- * Fixed in v6.0 - 7e193a42c37c
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,1,0)
+static void can327_set_xmit_lock_class(struct net_device *dev,
+				       struct netdev_queue *txq,
+				       void *key)
+{
+	lockdep_set_class(&txq->_xmit_lock, key);
+}
+
+/* A bonded channel calls dev_queue_xmit() on its peer from within
+ * ndo_start_xmit(), so with its own TX locks held. All can327 netdevs
+ * would share the lock classes of ARPHRD_CAN otherwise, and lockdep
+ * would take this for recursive locking. Like the bonding driver,
+ * give each channel classes of its own.
  */
-static int can327_do_set_bittiming(struct net_device *netdev)
+static void can327_lockdep_init(struct can327 *elm)
 {
-	return 0;
+	lockdep_register_key(&elm->xmit_lock_key);
+	lockdep_register_key(&elm->busylock_key);
+
+	netdev_for_each_tx_queue(elm->dev, can327_set_xmit_lock_class,
+				 &elm->xmit_lock_key);
+	elm->dev->qdisc_tx_busylock = &elm->busylock_key;
+}
+
+static void can327_lockdep_exit(struct can327 *elm)
+{
+	lockdep_unregister_key(&elm->busylock_key);
+	lockdep_unregister_key(&elm->xmit_lock_key);
 }
+#else
+static void can327_lockdep_init(struct can327 *elm) {}
+static void can327_lockdep_exit(struct can327 *elm) {}
 #endif
 
 static int can327_ldisc_open(struct tty_struct *tty)
@@ -1083,15 +4076,56 @@ static int can327_ldisc_open(struct tty_struct *tty)
 	if (!tty->ops->write)
 		return -EOPNOTSUPP;
 
-	dev = alloc_candev(sizeof(struct can327), 0);
+	dev = alloc_candev(sizeof(struct can327), CAN327_SIZE_ECHO);
 	if (!dev)
 		return -ENFILE;
 	elm = netdev_priv(dev);
 
+	elm->rxbuf_size = roundup_pow_of_two(clamp_val(READ_ONCE(rxbuf_size),
+						       CAN327_SIZE_RXBUF_MIN,
+						       CAN327_SIZE_RXBUF_MAX));
+	elm->rxbuf = kmalloc(elm->rxbuf_size, GFP_KERNEL);
+	elm->rxline = kmalloc(elm->rxbuf_size, GFP_KERNEL);
+	elm->rxcrmap = bitmap_zalloc(elm->rxbuf_size, GFP_KERNEL);
+	elm->rxstamps = kcalloc(elm->rxbuf_size, sizeof(*elm->rxstamps),
+				GFP_KERNEL);
+	if (!elm->rxbuf || !elm->rxline || !elm->rxcrmap || !elm->rxstamps) {
+		kfree(elm->rxbuf);
+		kfree(elm->rxline);
+		bitmap_free(elm->rxcrmap);
+		kfree(elm->rxstamps);
+		free_candev(dev);
+		return -ENOMEM;
+	}
+
 	/* Configure TTY interface */
 	tty->receive_room = 65536; /* We don't flow control */
 	spin_lock_init(&elm->lock);
+	spin_lock_init(&elm->tx_lock);
+	elm->txhead = elm->txbuf;
+	elm->backend = &can327_backend_elm;
+	elm->perf.since = ktime_get();
+	elm->perf.state_since = elm->perf.since;
 	INIT_WORK(&elm->tx_work, can327_ldisc_tx_worker);
+	INIT_WORK(&elm->baud_work, can327_baud_worker);
+	INIT_WORK(&elm->rx_pool_work, can327_rx_pool_worker);
+	skb_queue_head_init(&elm->rx_pool);
+	ewma_can327_batch_init(&elm->rx_batch_avg);
+
+	/* The RX buffer is parsed in NAPI context. This stays disabled
+	 * until the netdev is opened.
+	 */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,19,0)
+	netif_napi_add_weight(dev, &elm->rx_napi, can327_rx_poll,
+			      NAPI_POLL_WEIGHT);
+#else
+	netif_napi_add(dev, &elm->rx_napi, can327_rx_poll, NAPI_POLL_WEIGHT);
+#endif
+	INIT_DELAYED_WORK(&elm->baud_timeout_work,
+			  can327_baud_timeout_worker);
+	INIT_DELAYED_WORK(&elm->err_work, can327_err_worker);
+	elm->err_next = jiffies; /* jiffies start out before 0 */
+	INIT_KFIFO(elm->tx_fifo);
 
 	/* Configure CAN metadata */
 	elm->can.bitrate_const = can327_bitrate_const;
@@ -1104,24 +4138,102 @@ static int can327_ldisc_open(struct tty_struct *tty)
 
 	/* Configure netdev interface */
 	elm->dev = dev;
+	dev->flags |= IFF_ECHO;
 	dev->netdev_ops = &can327_netdev_ops;
+	dev->ethtool_ops = &can327_ethtool_ops;
+	dev->sysfs_groups[0] = &can327_sysfs_group;
+	can327_lockdep_init(elm);
 
 	/* Mark ldisc channel as alive */
 	elm->tty = tty;
 	tty->disc_data = elm;
+	can327_update_byte_time(elm);
 
 	/* Let 'er rip */
 	err = register_candev(elm->dev);
 	if (err) {
+		netif_napi_del(&elm->rx_napi);
+		kfree(elm->rxbuf);
+		kfree(elm->rxline);
+		bitmap_free(elm->rxcrmap);
+		kfree(elm->rxstamps);
+		can327_lockdep_exit(elm);
 		free_candev(elm->dev);
 		return err;
 	}
 
+	/* Errors are fine here, debugfs is optional. */
+	elm->debugfs = debugfs_create_dir(tty->name, can327_debugfs);
+	debugfs_create_file("stats", 0444, elm->debugfs, elm,
+			    &can327_debugfs_stats_fops);
+
 	netdev_info(elm->dev, "can327 on %s.\n", tty->name);
 
 	return 0;
 }
 
+static struct can327_bond *can327_bond_of(struct can327 *elm)
+{
+	return rcu_dereference_protected(elm->bond,
+					 lockdep_is_held(&can327_bond_lock));
+}
+
+/* Leave any bond, on either side. Called as the channel goes away. */
+static void can327_unbond(struct can327 *elm)
+{
+	struct can327_bond *bond;
+	struct can327_bond *rest;
+	struct can327 *master;
+	bool was_peer = false;
+	unsigned int i;
+
+	mutex_lock(&can327_bond_lock);
+
+	bond = can327_bond_of(elm);
+	if (bond) {
+		for (i = 0; i < bond->count; i++)
+			bond->peers[i]->bond_master = NULL;
+
+		RCU_INIT_POINTER(elm->bond, NULL);
+		kfree_rcu(bond, rcu);
+	}
+
+	master = elm->bond_master;
+	if (master) {
+		bond = can327_bond_of(master);
+
+		/* The other peers carry on without us */
+		rest = NULL;
+		if (bond->count > 1) {
+			rest = kzalloc(sizeof(*rest), GFP_KERNEL);
+			if (!rest)
+				netdev_warn(master->dev,
+					    "Out of memory, sending without TX peers.\n");
+		}
+
+		for (i = 0; i < bond->count; i++) {
+			if (bond->peers[i] == elm)
+				continue;
+
+			if (rest)
+				rest->peers[rest->count++] = bond->peers[i];
+			else
+				bond->peers[i]->bond_master = NULL;
+		}
+
+		rcu_assign_pointer(master->bond, rest);
+		kfree_rcu(bond, rcu);
+		elm->bond_master = NULL;
+		was_peer = true;
+	}
+
+	mutex_unlock(&can327_bond_lock);
+
+	/* Wait for the master's start_xmit to stop sending through us */
+	if (was_peer)
+		synchronize_rcu();
+}
+
 /* Close down a can327 channel.
  * This means flushing out any pending queues, and then returning.
  * This call is serialized against other ldisc functions:
@@ -1133,12 +4245,17 @@ static void can327_ldisc_close(struct tty_struct *tty)
 {
 	struct can327 *elm = (struct can327 *)tty->disc_data;
 
+	debugfs_remove_recursive(elm->debugfs);
+
 	/* unregister_netdev() calls .ndo_stop() so we don't have to.
 	 * Our .ndo_stop() also flushes the TTY write wakeup handler,
 	 * so we can safely set elm->tty = NULL after this.
 	 */
 	unregister_candev(elm->dev);
 
+	/* Once unregistered, we can't be made a TX peer anymore */
+	can327_unbond(elm);
+
 	/* Mark channel as dead */
 	spin_lock_bh(&elm->lock);
 	tty->disc_data = NULL;
@@ -1147,9 +4264,246 @@ static void can327_ldisc_close(struct tty_struct *tty)
 
 	netdev_info(elm->dev, "can327 off %s.\n", tty->name);
 
+	cancel_work_sync(&elm->rx_pool_work);
+	cancel_delayed_work_sync(&elm->err_work);
+	skb_queue_purge(&elm->rx_pool);
+
+	netif_napi_del(&elm->rx_napi);
+	kfree(elm->rxbuf);
+	kfree(elm->rxline);
+	bitmap_free(elm->rxcrmap);
+	kfree(elm->rxstamps);
+	can327_lockdep_exit(elm);
 	free_candev(elm->dev);
 }
 
+static int can327_set_hw_filters(struct can327 *elm,
+				 const struct can327_hw_filter_list *list)
+{
+	struct can327_hw_filter_list filters = { .count = list->count };
+	bool kicked = false;
+	unsigned int i;
+
+	if (list->count > CAN327_MAX_HW_FILTERS)
+		return -EINVAL;
+
+	for (i = 0; i < list->count; i++) {
+		const struct can327_hw_filter *filter = &list->filter[i];
+		u32 full_mask = filter->can_id & CAN_EFF_FLAG ?
+				CAN_EFF_MASK : CAN_SFF_MASK;
+
+		if ((filter->can_id & ~CAN_EFF_FLAG) & ~full_mask ||
+		    filter->can_mask & ~full_mask)
+			return -EINVAL;
+
+		/* A filter passing everything makes the others moot */
+		if (!filter->can_mask) {
+			filters.count = 0;
+			break;
+		}
+
+		filters.filter[i] = *filter;
+	}
+
+	spin_lock_bh(&elm->lock);
+
+	/* Unused entries are zeroed, so the shadow state can memcmp() */
+	elm->hw_filters = filters;
+
+	/* Apply it right away if the channel is up.
+	 * Otherwise, can327_init_device() will take care of it.
+	 */
+	if (elm->tty && netif_running(elm->dev) && !elm->uart_side_failure) {
+		set_bit(CAN327_TX_DO_CAN_FILTER, &elm->cmds_todo);
+		can327_kick_into_cmd_mode(elm);
+		kicked = true;
+	}
+
+	spin_unlock_bh(&elm->lock);
+
+	if (kicked)
+		can327_tx_flush(elm);
+
+	return 0;
+}
+
+static bool can327_is_valid_canid(canid_t can_id)
+{
+	u32 full_mask = can_id & CAN_EFF_FLAG ? CAN_EFF_MASK : CAN_SFF_MASK;
+
+	return !((can_id & ~CAN_EFF_FLAG) & ~full_mask);
+}
+
+static int can327_set_flow_control(struct can327 *elm,
+				   const struct can327_flow_control_list *list)
+{
+	struct can327_flow_control_list table = { .count = list->count };
+	unsigned int i;
+
+	if (list->count > CAN327_MAX_FLOW_CONTROL)
+		return -EINVAL;
+
+	for (i = 0; i < list->count; i++) {
+		const struct can327_flow_control *fc = &list->entry[i];
+
+		if (!can327_is_valid_canid(fc->tx_id) ||
+		    !can327_is_valid_canid(fc->fc_id) ||
+		    fc->reserved[0] || fc->reserved[1])
+			return -EINVAL;
+
+		table.entry[i] = *fc;
+	}
+
+	/* This takes effect with the next frame sent. */
+	spin_lock_bh(&elm->lock);
+	elm->fc_table = table;
+	spin_unlock_bh(&elm->lock);
+
+	return 0;
+}
+
+static int can327_set_tx_deadlines(struct can327 *elm,
+				   const struct can327_tx_deadline_list *list)
+{
+	struct can327_tx_deadline_list table = {
+		.count = list->count,
+		.default_us = list->default_us,
+	};
+	unsigned int i;
+
+	if (list->count > CAN327_MAX_TX_DEADLINES)
+		return -EINVAL;
+
+	for (i = 0; i < list->count; i++) {
+		const struct can327_tx_deadline *d = &list->entry[i];
+
+		if (!can327_is_valid_canid(d->can_id) ||
+		    d->can_mask & ~CAN_EFF_MASK || !d->deadline_us)
+			return -EINVAL;
+
+		table.entry[i] = *d;
+	}
+
+	/* This takes effect with the frames that reach tx_sched next. */
+	spin_lock_bh(&elm->lock);
+	elm->tx_deadlines = table;
+	spin_unlock_bh(&elm->lock);
+
+	return 0;
+}
+
+/* Send through the channels in req from now on, see can327.h */
+static int can327_set_bond_peers(struct can327 *elm,
+				 const struct can327_bond_peers *req)
+{
+	struct can327_bond *bond = NULL;
+	struct can327_bond *old;
+	struct net_device *dev;
+	struct can327 *peer;
+	unsigned int i, j;
+	int err = 0;
+
+	if (req->count > CAN327_MAX_BOND_PEERS)
+		return -EINVAL;
+
+	if (req->count) {
+		bond = kzalloc(sizeof(*bond), GFP_KERNEL);
+		if (!bond)
+			return -ENOMEM;
+	}
+
+	mutex_lock(&can327_bond_lock);
+
+	/* A TX peer can't have peers of its own */
+	if (elm->bond_master) {
+		err = -EBUSY;
+		goto out;
+	}
+
+	for (i = 0; i < req->count; i++) {
+		dev = dev_get_by_index(dev_net(elm->dev), req->ifindex[i]);
+		if (!dev) {
+			err = -ENODEV;
+			goto out;
+		}
+
+		if (dev->netdev_ops != &can327_netdev_ops) {
+			dev_put(dev);
+			err = -EINVAL;
+			goto out;
+		}
+
+		/* Channels leave their bonds in can327_unbond(), under
+		 * can327_bond_lock, so there's no need to hold on to dev.
+		 */
+		peer = netdev_priv(dev);
+		dev_put(dev);
+
+		if (peer == elm || rcu_access_pointer(peer->bond) ||
+		    (peer->bond_master && peer->bond_master != elm)) {
+			err = -EBUSY;
+			goto out;
+		}
+
+		for (j = 0; j < i; j++) {
+			if (bond->peers[j] == peer) {
+				err = -EINVAL;
+				goto out;
+			}
+		}
+
+		bond->peers[i] = peer;
+		bond->count++;
+	}
+
+	old = can327_bond_of(elm);
+	if (old) {
+		for (i = 0; i < old->count; i++)
+			old->peers[i]->bond_master = NULL;
+	}
+
+	for (i = 0; i < req->count; i++)
+		bond->peers[i]->bond_master = elm;
+
+	rcu_assign_pointer(elm->bond, bond);
+	mutex_unlock(&can327_bond_lock);
+
+	/* The peers dropped no longer wait in can327_unbond() for our
+	 * start_xmit to stop sending through them, so wait here.
+	 */
+	if (old) {
+		synchronize_rcu();
+		kfree(old);
+	}
+
+	return 0;
+
+out:
+	mutex_unlock(&can327_bond_lock);
+	kfree(bond);
+	return err;
+}
+
+static void can327_get_bond_peers(struct can327 *elm,
+				  struct can327_bond_peers *req)
+{
+	struct can327_bond *bond;
+	unsigned int i;
+
+	memset(req, 0, sizeof(*req));
+
+	mutex_lock(&can327_bond_lock);
+
+	bond = can327_bond_of(elm);
+	if (bond) {
+		req->count = bond->count;
+		for (i = 0; i < bond->count; i++)
+			req->ifindex[i] = bond->peers[i]->dev->ifindex;
+	}
+
+	mutex_unlock(&can327_bond_lock);
+}
+
 static int can327_ldisc_ioctl(struct tty_struct *tty,
 #if LINUX_VERSION_CODE < KERNEL_VERSION(5,17,0)
 			      struct file *file,
@@ -1157,6 +4511,10 @@ static int can327_ldisc_ioctl(struct tty_struct *tty,
 			      unsigned int cmd, unsigned long arg)
 {
 	struct can327 *elm = (struct can327 *)tty->disc_data;
+	struct can327_hw_filter_list filters;
+	struct can327_flow_control_list fc_table;
+	struct can327_bond_peers bond_peers;
+	struct can327_tx_deadline_list deadlines;
 	unsigned int tmp;
 
 	switch (cmd) {
@@ -1169,6 +4527,88 @@ static int can327_ldisc_ioctl(struct tty_struct *tty,
 	case SIOCSIFHWADDR:
 		return -EINVAL;
 
+	case CAN327_IOC_SET_HW_FILTER:
+		if (!capable(CAP_NET_ADMIN))
+			return -EPERM;
+		if (copy_from_user(&filters.filter[0], (void __user *)arg,
+				   sizeof(filters.filter[0])))
+			return -EFAULT;
+		filters.count = 1;
+		return can327_set_hw_filters(elm, &filters);
+
+	case CAN327_IOC_GET_HW_FILTER:
+		spin_lock_bh(&elm->lock);
+		filters = elm->hw_filters;
+		spin_unlock_bh(&elm->lock);
+		/* Entries past count are zero, i.e. receive everything */
+		if (copy_to_user((void __user *)arg, &filters.filter[0],
+				 sizeof(filters.filter[0])))
+			return -EFAULT;
+		return 0;
+
+	case CAN327_IOC_SET_HW_FILTERS:
+		if (!capable(CAP_NET_ADMIN))
+			return -EPERM;
+		if (copy_from_user(&filters, (void __user *)arg, sizeof(filters)))
+			return -EFAULT;
+		return can327_set_hw_filters(elm, &filters);
+
+	case CAN327_IOC_GET_HW_FILTERS:
+		spin_lock_bh(&elm->lock);
+		filters = elm->hw_filters;
+		spin_unlock_bh(&elm->lock);
+		if (copy_to_user((void __user *)arg, &filters, sizeof(filters)))
+			return -EFAULT;
+		return 0;
+
+	case CAN327_IOC_SET_FLOW_CONTROL:
+		if (!capable(CAP_NET_ADMIN))
+			return -EPERM;
+		if (copy_from_user(&fc_table, (void __user *)arg,
+				   sizeof(fc_table)))
+			return -EFAULT;
+		return can327_set_flow_control(elm, &fc_table);
+
+	case CAN327_IOC_GET_FLOW_CONTROL:
+		spin_lock_bh(&elm->lock);
+		fc_table = elm->fc_table;
+		spin_unlock_bh(&elm->lock);
+		if (copy_to_user((void __user *)arg, &fc_table, sizeof(fc_table)))
+			return -EFAULT;
+		return 0;
+
+	case CAN327_IOC_SET_BOND_PEERS:
+		if (!capable(CAP_NET_ADMIN))
+			return -EPERM;
+		if (copy_from_user(&bond_peers, (void __user *)arg,
+				   sizeof(bond_peers)))
+			return -EFAULT;
+		return can327_set_bond_peers(elm, &bond_peers);
+
+	case CAN327_IOC_GET_BOND_PEERS:
+		can327_get_bond_peers(elm, &bond_peers);
+		if (copy_to_user((void __user *)arg, &bond_peers,
+				 sizeof(bond_peers)))
+			return -EFAULT;
+		return 0;
+
+	case CAN327_IOC_SET_TX_DEADLINES:
+		if (!capable(CAP_NET_ADMIN))
+			return -EPERM;
+		if (copy_from_user(&deadlines, (void __user *)arg,
+				   sizeof(deadlines)))
+			return -EFAULT;
+		return can327_set_tx_deadlines(elm, &deadlines);
+
+	case CAN327_IOC_GET_TX_DEADLINES:
+		spin_lock_bh(&elm->lock);
+		deadlines = elm->tx_deadlines;
+		spin_unlock_bh(&elm->lock);
+		if (copy_to_user((void __user *)arg, &deadlines,
+				 sizeof(deadlines)))
+			return -EFAULT;
+		return 0;
+
 	default:
 #if LINUX_VERSION_CODE < KERNEL_VERSION(5,16,0)
 		return tty_mode_ioctl(tty, file, cmd, arg);
@@ -1193,13 +4633,25 @@ static int __init can327_init(void)
 {
 	int status;
 
+	/* Each command waits for the TTY, so don't queue it behind
+	 * unrelated work.
+	 */
+	can327_wq = alloc_workqueue("can327", WQ_HIGHPRI | WQ_UNBOUND, 0);
+	if (!can327_wq)
+		return -ENOMEM;
+
+	can327_debugfs = debugfs_create_dir("can327", NULL);
+
 #if LINUX_VERSION_CODE < KERNEL_VERSION(5,14,0)
 	status = tty_register_ldisc(N_DEVELOPMENT, &can327_ldisc);
 #else
 	status = tty_register_ldisc(&can327_ldisc);
 #endif
-	if (status)
+	if (status) {
 		pr_err("Can't register line discipline\n");
+		debugfs_remove_recursive(can327_debugfs);
+		destroy_workqueue(can327_wq);
+	}
 
 	return status;
 }
@@ -1219,6 +4671,9 @@ static void __exit can327_exit(void)
 #else
 	tty_unregister_ldisc(&can327_ldisc);
 #endif
+
+	debugfs_remove_recursive(can327_debugfs);
+	destroy_workqueue(can327_wq);
 }
 
 module_init(can327_init);
@@ -1228,3 +4683,7 @@ MODULE_ALIAS_LDISC(N_DEVELOPMENT);
 MODULE_DESCRIPTION("ELM327 based CAN interface");
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Max Staudt <max@enpas.org>");
+
+#if IS_ENABLED(CONFIG_CAN327_KUNIT_TEST)
+#include "can327_test.c"
+#endif
@@ -0,0 +1,128 @@
+/* SPDX-License-Identifier: GPL-2.0 WITH Linux-syscall-note */
+/* ELM327 based CAN interface driver (tty line discipline)
+ *
+ * ioctl()s for configuring can327 channels from userspace.
+ * They are issued on the TTY the line discipline is attached to.
+ */
+
+#ifndef _CAN327_H
+#define _CAN327_H
+
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+#define CAN327_IOC_MAGIC 'E'
+
+/* ELM327 hardware CAN ID filter ("AT CF" / "AT CM" / "AT CRA").
+ *
+ * A received frame is forwarded over the UART if
+ * (received_can_id & can_mask) == (can_id & can_mask).
+ *
+ * Set CAN_EFF_FLAG in can_id to program a 29 bit filter.
+ * A can_mask of 0 receives all frames.
+ */
+struct can327_hw_filter {
+	__u32 can_id;
+	__u32 can_mask;
+};
+
+#define CAN327_IOC_SET_HW_FILTER _IOW(CAN327_IOC_MAGIC, 1, struct can327_hw_filter)
+#define CAN327_IOC_GET_HW_FILTER _IOR(CAN327_IOC_MAGIC, 2, struct can327_hw_filter)
+
+/* A set of hardware CAN ID filters.
+ * A frame is forwarded if it matches any of them. count == 0 receives
+ * all frames.
+ *
+ * STN chips support these natively ("STFAP"). On other chips, the
+ * driver programs a single filter that lets through at least all
+ * frames matching any of them, so userspace should filter as well.
+ */
+#define CAN327_MAX_HW_FILTERS 8
+
+struct can327_hw_filter_list {
+	__u32 count;
+	struct can327_hw_filter filter[CAN327_MAX_HW_FILTERS];
+};
+
+#define CAN327_IOC_SET_HW_FILTERS _IOW(CAN327_IOC_MAGIC, 3, struct can327_hw_filter_list)
+#define CAN327_IOC_GET_HW_FILTERS _IOR(CAN327_IOC_MAGIC, 4, struct can327_hw_filter_list)
+
+/* ISO 15765 flow control answered by the chip ("AT CFC1").
+ *
+ * After sending a frame with CAN ID tx_id, the chip answers First
+ * Frames in the replies with a Flow Control frame of its own:
+ * CAN ID fc_id, data 30 block_size st_min ("AT FC SH" / "AT FC SD").
+ * This saves a round trip through userspace, so the ECU's timeout
+ * isn't hit. The frames are still received as usual.
+ *
+ * Set CAN_EFF_FLAG in tx_id and fc_id for 29 bit IDs.
+ * reserved must be 0. count == 0 turns this off.
+ */
+#define CAN327_MAX_FLOW_CONTROL 8
+
+struct can327_flow_control {
+	__u32 tx_id;
+	__u32 fc_id;
+	__u8 block_size;
+	__u8 st_min;
+	__u8 reserved[2];
+};
+
+struct can327_flow_control_list {
+	__u32 count;
+	struct can327_flow_control entry[CAN327_MAX_FLOW_CONTROL];
+};
+
+#define CAN327_IOC_SET_FLOW_CONTROL _IOW(CAN327_IOC_MAGIC, 5, struct can327_flow_control_list)
+#define CAN327_IOC_GET_FLOW_CONTROL _IOR(CAN327_IOC_MAGIC, 6, struct can327_flow_control_list)
+
+/* Bonding several channels on the same bus.
+ *
+ * Issued on the TTY of the channel to receive with. That channel keeps
+ * monitoring the bus, and frames sent on its netdev go out through the
+ * given TX peers instead. The peer is picked by CAN ID, so frames with
+ * the same CAN ID stay in order. When our own frames show up in the
+ * monitor output, they are dropped, as the stack has echoed them
+ * already.
+ *
+ * Peers are given by ifindex, and must be can327 channels that are
+ * neither bonded themselves nor peers of another channel. Their
+ * netdevs must be up for sending. count == 0 unbonds.
+ */
+#define CAN327_MAX_BOND_PEERS 4
+
+struct can327_bond_peers {
+	__u32 count;
+	__s32 ifindex[CAN327_MAX_BOND_PEERS];
+};
+
+#define CAN327_IOC_SET_BOND_PEERS _IOW(CAN327_IOC_MAGIC, 7, struct can327_bond_peers)
+#define CAN327_IOC_GET_BOND_PEERS _IOR(CAN327_IOC_MAGIC, 8, struct can327_bond_peers)
+
+/* TX deadlines per CAN ID, for the tx_sched=3 module parameter.
+ *
+ * A queued frame should be sent within deadline_us of being queued,
+ * taken from the first entry where
+ * (frame_can_id & can_mask) == (can_id & can_mask). Frames matching no
+ * entry get default_us, or 1 second if that is 0.
+ *
+ * Set CAN_EFF_FLAG in can_id for 29 bit IDs. deadline_us must not be 0.
+ */
+#define CAN327_MAX_TX_DEADLINES 8
+
+struct can327_tx_deadline {
+	__u32 can_id;
+	__u32 can_mask;
+	__u32 deadline_us;
+};
+
+struct can327_tx_deadline_list {
+	__u32 count;
+	__u32 default_us;
+	struct can327_tx_deadline entry[CAN327_MAX_TX_DEADLINES];
+};
+
+#define CAN327_IOC_SET_TX_DEADLINES _IOW(CAN327_IOC_MAGIC, 9, struct can327_tx_deadline_list)
+#define CAN327_IOC_GET_TX_DEADLINES _IOR(CAN327_IOC_MAGIC, 10, struct can327_tx_deadline_list)
+
+#endif /* _CAN327_H */
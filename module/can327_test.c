@@ -0,0 +1,412 @@
+// SPDX-License-Identifier: GPL-2.0
+/* KUnit tests for the can327 RX parser.
+ *
+ * This is included at the end of can327.c, as the functions under test
+ * are static. Build the module with "make CONFIG_CAN327_KUNIT_TEST=y",
+ * and the suite runs when it's loaded into a kernel with KUnit.
+ *
+ * Each line goes through the RX buffer just like bytes from the TTY,
+ * so NULs are dropped on the way, and is then parsed by
+ * can327_parse_rxbuf() as while monitoring. The netdev isn't
+ * registered, and NAPI never runs, so the frames are picked up from
+ * the rx-offload queue. The lines with spaces are those in
+ * tools/parser-corpus.txt.
+ */
+
+#include <kunit/test.h>
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6,1,0)
+#error "The can327 KUnit tests need Linux 6.1 or later."
+#endif
+
+struct can327_test_line {
+	const char *line;
+	size_t len;
+	bool spaces_off;
+	bool ignored;		/* Command echo, neither frame nor error */
+	bool error;
+	enum can327_err kind;	/* If it's an error */
+	struct can_frame frame;	/* Otherwise */
+};
+
+#define CAN327_TEST_LINE(s) .line = s "\r", .len = sizeof(s "\r") - 1
+
+#define CAN327_TEST_FRAME(s, id, ...) {					\
+	CAN327_TEST_LINE(s),						\
+	.frame = {							\
+		.can_id = id,						\
+		.len = sizeof((u8[]){ __VA_ARGS__ }),			\
+		.data = { __VA_ARGS__ },				\
+	},								\
+}
+
+#define CAN327_TEST_RTR(s, id, dlc) {					\
+	CAN327_TEST_LINE(s),						\
+	.frame = { .can_id = (id) | CAN_RTR_FLAG, .len = dlc },	\
+}
+
+#define CAN327_TEST_ERROR(s, k) {					\
+	CAN327_TEST_LINE(s), .error = true, .kind = k,			\
+}
+
+static const struct can327_test_line can327_test_lines[] = {
+	/* SFF, all lengths */
+	{ CAN327_TEST_LINE("123 0 "), .frame = { .can_id = 0x123 } },
+	CAN327_TEST_FRAME("123 1 11 ", 0x123, 0x11),
+	CAN327_TEST_FRAME("7E8 8 02 41 00 BE 3F A8 13 00 ", 0x7e8,
+			  0x02, 0x41, 0x00, 0xbe, 0x3f, 0xa8, 0x13, 0x00),
+	CAN327_TEST_FRAME("7FF 8 FF FF FF FF FF FF FF FF ", 0x7ff,
+			  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff),
+	CAN327_TEST_FRAME("000 4 DE AD BE EF ", 0x000,
+			  0xde, 0xad, 0xbe, 0xef),
+
+	/* EFF */
+	CAN327_TEST_FRAME("18 DA F1 10 8 10 14 49 02 01 31 47 31 ",
+			  CAN_EFF_FLAG | 0x18daf110,
+			  0x10, 0x14, 0x49, 0x02, 0x01, 0x31, 0x47, 0x31),
+	{ CAN327_TEST_LINE("1F FF FF FF 0 "),
+	  .frame = { .can_id = CAN_EFF_FLAG | 0x1fffffff } },
+	CAN327_TEST_FRAME("00 00 00 01 3 01 02 03 ", CAN_EFF_FLAG | 0x1,
+			  0x01, 0x02, 0x03),
+
+	/* RTR */
+	CAN327_TEST_RTR("123 0 RTR", 0x123, 0),
+	CAN327_TEST_RTR("456 8 RTR", 0x456, 8),
+	CAN327_TEST_RTR("18 DB 33 F1 2 RTR", CAN_EFF_FLAG | 0x18db33f1, 2),
+
+	/* Cut short, then BUFFER FULL */
+	CAN327_TEST_ERROR("7E8 8 02 41 00 BEBUFFER FULL",
+			  CAN327_ERR_BUFFER_FULL),
+	CAN327_TEST_ERROR("18 DA F1 10 8 10 1BUFFER FULL",
+			  CAN327_ERR_BUFFER_FULL),
+	CAN327_TEST_ERROR("12BUFFER FULL", CAN327_ERR_BUFFER_FULL),
+
+	/* NULs, as some clones send them */
+	CAN327_TEST_FRAME("123 \0\0" "2 AB CD ", 0x123, 0xab, 0xcd),
+	CAN327_TEST_FRAME("\0" "7E8 3 01 02 03 ", 0x7e8, 0x01, 0x02, 0x03),
+	CAN327_TEST_FRAME("18 DA F1 10 \0" "1 FF ", CAN_EFF_FLAG | 0x18daf110,
+			  0xff),
+
+	/* Not frames */
+	CAN327_TEST_ERROR("CAN ERROR", CAN327_ERR_CAN_ERROR),
+	CAN327_TEST_ERROR("BUS ERROR", CAN327_ERR_BUS_ERROR),
+	CAN327_TEST_ERROR("<RX ERROR", CAN327_ERR_RX_ERROR),
+	CAN327_TEST_ERROR("123 9 00", CAN327_ERR_GARBLED),
+	CAN327_TEST_ERROR("7E8 3 41 0D 00 ?", CAN327_ERR_GARBLED),
+	{ CAN327_TEST_LINE("ATMA"), .ignored = true },
+	{ CAN327_TEST_LINE("STMA"), .ignored = true },
+
+	/* Spaces off (AT S0) */
+	{ CAN327_TEST_LINE("1238DEADBEEF12345678"), .spaces_off = true,
+	  .frame = { .can_id = 0x123, .len = 8,
+		     .data = { 0xde, 0xad, 0xbe, 0xef,
+			       0x12, 0x34, 0x56, 0x78 } } },
+	{ CAN327_TEST_LINE("123456782DEAD"), .spaces_off = true,
+	  .frame = { .can_id = CAN_EFF_FLAG | 0x12345678, .len = 2,
+		     .data = { 0xde, 0xad } } },
+	{ CAN327_TEST_LINE("1230"), .spaces_off = true,
+	  .frame = { .can_id = 0x123 } },
+	{ CAN327_TEST_LINE("1238RTR"), .spaces_off = true,
+	  .frame = { .can_id = 0x123 | CAN_RTR_FLAG, .len = 8 } },
+	{ CAN327_TEST_LINE("1232DEADBUFFER FULL"), .spaces_off = true,
+	  .error = true, .kind = CAN327_ERR_BUFFER_FULL },
+	{ CAN327_TEST_LINE("1238DEAD"), .spaces_off = true,
+	  .error = true, .kind = CAN327_ERR_GARBLED },
+	{ CAN327_TEST_LINE("1238DE?D"), .spaces_off = true,
+	  .error = true, .kind = CAN327_ERR_GARBLED },
+	{ CAN327_TEST_LINE("1BUFFER FULL"), .spaces_off = true,
+	  .error = true, .kind = CAN327_ERR_BUFFER_FULL },
+};
+
+static void can327_test_line_desc(const struct can327_test_line *t,
+				  char *desc)
+{
+	size_t i, n = 0;
+
+	/* Show NULs, and leave out the <CR> */
+	for (i = 0; i < t->len - 1; i++) {
+		if (t->line[i])
+			n += scnprintf(desc + n, KUNIT_PARAM_DESC_SIZE - n,
+				       "%c", t->line[i]);
+		else
+			n += scnprintf(desc + n, KUNIT_PARAM_DESC_SIZE - n,
+				       "\\0");
+	}
+}
+
+KUNIT_ARRAY_PARAM(can327_lines, can327_test_lines, can327_test_line_desc);
+
+/* Put bytes into the RX buffer, as can327_ldisc_rx() does. */
+static void can327_test_rx(struct kunit *test, struct can327 *elm,
+			   const char *line, unsigned int count)
+{
+	const u8 *cp = (const u8 *)line;
+	int taken;
+
+	while (count) {
+		taken = can327_rx_fast(elm, cp, count, 0);
+		if (!taken)
+			taken = can327_rx_slow(elm, cp, NULL, count, 0);
+		KUNIT_ASSERT_GT(test, taken, 0);
+
+		cp += taken;
+		count -= taken;
+	}
+}
+
+/* Parse everything in the RX buffer, as in can327_rx_poll() */
+static void can327_test_parse(struct kunit *test, struct can327 *elm)
+{
+	spin_lock_bh(&elm->lock);
+	can327_parse_rxbuf(elm, NAPI_POLL_WEIGHT);
+	can327_flush_rx_batch(elm);
+	KUNIT_EXPECT_EQ(test, can327_rxfill(elm), 0);
+	spin_unlock_bh(&elm->lock);
+}
+
+/* Take the next data frame that was handed to the network stack.
+ * Error frames are skipped.
+ */
+static struct sk_buff *can327_test_next_frame(struct can327 *elm)
+{
+	struct sk_buff *skb;
+
+	while ((skb = skb_dequeue(&elm->offload.skb_queue))) {
+		if (!(((struct can_frame *)skb->data)->can_id & CAN_ERR_FLAG))
+			return skb;
+
+		kfree_skb(skb);
+	}
+
+	return NULL;
+}
+
+static void can327_test_expect_frame(struct kunit *test, struct can327 *elm,
+				     const struct can_frame *want)
+{
+	struct sk_buff *skb = can327_test_next_frame(elm);
+	struct can_frame *frame;
+
+	KUNIT_ASSERT_NOT_NULL(test, skb);
+	frame = (struct can_frame *)skb->data;
+
+	KUNIT_EXPECT_EQ(test, frame->can_id, want->can_id);
+	KUNIT_EXPECT_EQ(test, frame->len, want->len);
+	if (frame->len == want->len && !(frame->can_id & CAN_RTR_FLAG))
+		KUNIT_EXPECT_MEMEQ(test, frame->data, want->data, frame->len);
+
+	kfree_skb(skb);
+}
+
+static void can327_test_frame(struct kunit *test)
+{
+	const struct can327_test_line *t = test->param_value;
+	struct can327 *elm = test->priv;
+	enum can327_err kind;
+
+	elm->rx_spaces_off = t->spaces_off;
+	can327_test_rx(test, elm, t->line, t->len);
+	can327_test_parse(test, elm);
+
+	if (!t->error) {
+		if (!t->ignored)
+			can327_test_expect_frame(test, elm, &t->frame);
+		KUNIT_EXPECT_NULL(test, can327_test_next_frame(elm));
+
+		for (kind = 0; kind < CAN327_NUM_ERRS; kind++)
+			KUNIT_EXPECT_EQ(test, elm->errors[kind], 0);
+		KUNIT_EXPECT_EQ(test, elm->state, CAN327_STATE_RECEIVING);
+		return;
+	}
+
+	KUNIT_EXPECT_NULL(test, can327_test_next_frame(elm));
+	KUNIT_EXPECT_EQ_MSG(test, elm->errors[t->kind], 1,
+			    "expected %s", can327_errs[t->kind].name);
+
+	/* BUFFER FULL counts towards overflow_baudrate */
+	KUNIT_EXPECT_EQ(test, elm->dev->stats.rx_over_errors,
+			t->kind == CAN327_ERR_BUFFER_FULL);
+
+	/* BUFFER FULL is followed by a prompt, anything else gets the
+	 * chip kicked.
+	 */
+	if (t->kind != CAN327_ERR_BUFFER_FULL) {
+		KUNIT_EXPECT_EQ(test, elm->state, CAN327_STATE_GETDUMMYCHAR);
+		KUNIT_EXPECT_EQ(test, elm->txleft, 1);
+		KUNIT_EXPECT_EQ(test, elm->txhead[0], CAN327_DUMMY_CHAR);
+	} else {
+		KUNIT_EXPECT_EQ(test, elm->state, CAN327_STATE_RECEIVING);
+		KUNIT_EXPECT_EQ(test, elm->txleft, 0);
+	}
+}
+
+/* Lines wrapping around the end of the ring buffer are copied to
+ * elm->rxline, and must come out the same.
+ */
+static void can327_test_wrap(struct kunit *test)
+{
+	const struct can327_test_line *t = &can327_test_lines[2];
+	struct can327 *elm = test->priv;
+	unsigned int i;
+
+	for (i = 0; i < t->len; i++) {
+		spin_lock_bh(&elm->lock);
+		elm->rxhead = elm->rxbuf_size - i;
+		elm->rxtail = elm->rxhead;
+		elm->rxscan = elm->rxhead;
+		spin_unlock_bh(&elm->lock);
+
+		can327_test_rx(test, elm, t->line, t->len);
+		can327_test_parse(test, elm);
+		can327_test_expect_frame(test, elm, &t->frame);
+	}
+}
+
+/* Our own frames, sent through a TX peer, are dropped once when they
+ * show up on the bus. The same frame after that is someone else's.
+ */
+static void can327_test_bond_echo(struct kunit *test)
+{
+	const struct can327_test_line *t = &can327_test_lines[2];
+	struct can327 *elm = test->priv;
+	struct can327_bond *bond;
+
+	bond = kunit_kzalloc(test, sizeof(*bond), GFP_KERNEL);
+	KUNIT_ASSERT_NOT_NULL(test, bond);
+
+	spin_lock_bh(&elm->lock);
+	RCU_INIT_POINTER(elm->bond, bond);
+	elm->bond_echoes[0].frame = t->frame;
+	elm->bond_echoes[0].sent = ktime_get();
+	spin_unlock_bh(&elm->lock);
+
+	can327_test_rx(test, elm, t->line, t->len);
+	can327_test_parse(test, elm);
+	KUNIT_EXPECT_NULL(test, can327_test_next_frame(elm));
+	KUNIT_EXPECT_EQ(test, elm->bond_echoes_suppressed, 1);
+
+	can327_test_rx(test, elm, t->line, t->len);
+	can327_test_parse(test, elm);
+	can327_test_expect_frame(test, elm, &t->frame);
+	KUNIT_EXPECT_EQ(test, elm->bond_echoes_suppressed, 1);
+
+	RCU_INIT_POINTER(elm->bond, NULL);
+}
+
+#define CAN327_TEST_ROUNDS 1000
+
+/* Not a test as such: Report how long parsing takes per line, to
+ * compare before and after changing the parser.
+ */
+static void can327_test_speed(struct kunit *test)
+{
+	struct can327 *elm = test->priv;
+	u64 lines = 0;
+	u64 ns = 0;
+	u64 start;
+	unsigned int round;
+	unsigned int i;
+
+	for (round = 0; round < CAN327_TEST_ROUNDS; round++) {
+		for (i = 0; i < ARRAY_SIZE(can327_test_lines); i++) {
+			const struct can327_test_line *t = &can327_test_lines[i];
+
+			/* Only time lines that keep the chip monitoring */
+			if (t->spaces_off ||
+			    (t->error && t->kind != CAN327_ERR_BUFFER_FULL))
+				continue;
+
+			can327_test_rx(test, elm, t->line, t->len);
+
+			spin_lock_bh(&elm->lock);
+			start = ktime_get_ns();
+			can327_parse_rxbuf(elm, NAPI_POLL_WEIGHT);
+			ns += ktime_get_ns() - start;
+			spin_unlock_bh(&elm->lock);
+
+			skb_queue_purge(&elm->offload.skb_queue);
+			lines++;
+		}
+	}
+
+	kunit_info(test, "%llu ns per line, over %llu lines\n",
+		   div64_u64(ns, lines), lines);
+}
+
+static int can327_test_init(struct kunit *test)
+{
+	struct net_device *dev;
+	struct can327 *elm;
+	int err;
+
+	dev = alloc_candev(sizeof(struct can327), CAN327_SIZE_ECHO);
+	KUNIT_ASSERT_NOT_NULL(test, dev);
+	elm = netdev_priv(dev);
+	elm->dev = dev;
+
+	elm->rxbuf_size = CAN327_SIZE_RXBUF;
+	elm->rxbuf = kunit_kzalloc(test, elm->rxbuf_size, GFP_KERNEL);
+	elm->rxline = kunit_kzalloc(test, elm->rxbuf_size, GFP_KERNEL);
+	elm->rxcrmap = kunit_kcalloc(test, BITS_TO_LONGS(elm->rxbuf_size),
+				     sizeof(long), GFP_KERNEL);
+	elm->rxstamps = kunit_kcalloc(test, elm->rxbuf_size,
+				      sizeof(*elm->rxstamps), GFP_KERNEL);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, elm->rxbuf);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, elm->rxline);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, elm->rxcrmap);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, elm->rxstamps);
+
+	/* What can327_ldisc_open() sets up for the RX path */
+	spin_lock_init(&elm->lock);
+	spin_lock_init(&elm->tx_lock);
+	elm->txhead = elm->txbuf;
+	elm->backend = &can327_backend_elm;
+	INIT_WORK(&elm->rx_pool_work, can327_rx_pool_worker);
+	skb_queue_head_init(&elm->rx_pool);
+	INIT_DELAYED_WORK(&elm->err_work, can327_err_worker);
+	elm->err_next = jiffies;
+
+	/* NAPI is never enabled, so the frames stay in its queue. */
+	err = can_rx_offload_add_manual(dev, &elm->offload, NAPI_POLL_WEIGHT);
+	if (err) {
+		free_candev(dev);
+		KUNIT_ASSERT_EQ(test, err, 0);
+	}
+
+	/* Frames are only handed on while the netdev is up. */
+	set_bit(__LINK_STATE_START, &dev->state);
+	elm->state = CAN327_STATE_RECEIVING;
+
+	test->priv = elm;
+
+	return 0;
+}
+
+static void can327_test_exit(struct kunit *test)
+{
+	struct can327 *elm = test->priv;
+
+	clear_bit(__LINK_STATE_START, &elm->dev->state);
+	cancel_work_sync(&elm->rx_pool_work);
+	cancel_delayed_work_sync(&elm->err_work);
+	skb_queue_purge(&elm->rx_pool);
+	can_rx_offload_del(&elm->offload);
+	free_candev(elm->dev);
+}
+
+static struct kunit_case can327_test_cases[] = {
+	KUNIT_CASE_PARAM(can327_test_frame, can327_lines_gen_params),
+	KUNIT_CASE(can327_test_wrap),
+	KUNIT_CASE(can327_test_bond_echo),
+	KUNIT_CASE(can327_test_speed),
+	{}
+};
+
+static struct kunit_suite can327_test_suite = {
+	.name = "can327",
+	.init = can327_test_init,
+	.exit = can327_test_exit,
+	.test_cases = can327_test_cases,
+};
+
+kunit_test_suite(can327_test_suite);
@@ -0,0 +1,179 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/* ELM327 based CAN interface driver (tty line discipline)
+ *
+ * Tracepoints at the boundaries between the UART, the state machine
+ * and the network stack.
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM can327
+
+#if !defined(_CAN327_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _CAN327_TRACE_H
+
+#include <linux/netdevice.h>
+#include <linux/string.h>
+#include <linux/tracepoint.h>
+
+#ifndef _CAN327_TRACE_HELPERS
+#define _CAN327_TRACE_HELPERS
+
+/* Enough for the longest line we send, an EFF frame sent with STPX */
+#define CAN327_TRACE_LINE_LEN 40
+
+/* Long enough for the names of states and error kinds */
+#define CAN327_TRACE_NAME_LEN 20
+
+/* Copy a line without its <CR>, NUL terminated and maybe truncated */
+static inline void can327_trace_copy_line(char *dst, const u8 *src,
+					  size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len && i < CAN327_TRACE_LINE_LEN - 1; i++) {
+		if (src[i] == '\r')
+			break;
+		dst[i] = src[i];
+	}
+
+	dst[i] = '\0';
+}
+
+#endif /* _CAN327_TRACE_HELPERS */
+
+/* Data queued for the UART: A command, a frame, a CR or a dummy char */
+TRACE_EVENT(can327_send,
+	TP_PROTO(const struct net_device *dev, const u8 *buf, size_t len),
+	TP_ARGS(dev, buf, len),
+
+	TP_STRUCT__entry(
+		__array(char, ifname, IFNAMSIZ)
+		__field(size_t, len)
+		__array(char, line, CAN327_TRACE_LINE_LEN)
+	),
+
+	TP_fast_assign(
+		strscpy(__entry->ifname, dev->name, IFNAMSIZ);
+		__entry->len = len;
+		can327_trace_copy_line(__entry->line, buf, len);
+	),
+
+	TP_printk("%s: %zu bytes \"%s\"",
+		  __entry->ifname, __entry->len, __entry->line)
+);
+
+/* A chunk of data from the TTY, before it's taken into the RX buffer */
+TRACE_EVENT(can327_rx_chunk,
+	TP_PROTO(const struct net_device *dev, unsigned int count,
+		 bool flags),
+	TP_ARGS(dev, count, flags),
+
+	TP_STRUCT__entry(
+		__array(char, ifname, IFNAMSIZ)
+		__field(unsigned int, count)
+		__field(bool, flags)
+	),
+
+	TP_fast_assign(
+		strscpy(__entry->ifname, dev->name, IFNAMSIZ);
+		__entry->count = count;
+		__entry->flags = flags;
+	),
+
+	TP_printk("%s: %u bytes%s", __entry->ifname, __entry->count,
+		  __entry->flags ? ", some flagged" : "")
+);
+
+/* A line from the ELM327, and what the parser made of it */
+TRACE_EVENT(can327_rx_line,
+	TP_PROTO(const struct net_device *dev, const u8 *line, size_t len,
+		 const char *kind),
+	TP_ARGS(dev, line, len, kind),
+
+	TP_STRUCT__entry(
+		__array(char, ifname, IFNAMSIZ)
+		__array(char, kind, CAN327_TRACE_NAME_LEN)
+		__array(char, line, CAN327_TRACE_LINE_LEN)
+	),
+
+	TP_fast_assign(
+		strscpy(__entry->ifname, dev->name, IFNAMSIZ);
+		strscpy(__entry->kind, kind, CAN327_TRACE_NAME_LEN);
+		can327_trace_copy_line(__entry->line, line, len);
+	),
+
+	TP_printk("%s: %s \"%s\"",
+		  __entry->ifname, __entry->kind, __entry->line)
+);
+
+TRACE_EVENT(can327_state,
+	TP_PROTO(const struct net_device *dev, const char *from,
+		 const char *to),
+	TP_ARGS(dev, from, to),
+
+	TP_STRUCT__entry(
+		__array(char, ifname, IFNAMSIZ)
+		__array(char, from, CAN327_TRACE_NAME_LEN)
+		__array(char, to, CAN327_TRACE_NAME_LEN)
+	),
+
+	TP_fast_assign(
+		strscpy(__entry->ifname, dev->name, IFNAMSIZ);
+		strscpy(__entry->from, from, CAN327_TRACE_NAME_LEN);
+		strscpy(__entry->to, to, CAN327_TRACE_NAME_LEN);
+	),
+
+	TP_printk("%s: %s -> %s",
+		  __entry->ifname, __entry->from, __entry->to)
+);
+
+/* A prompt has been handled. The bits in before but not in after
+ * have been sent, see enum can327_tx_do.
+ */
+TRACE_EVENT(can327_cmds_todo,
+	TP_PROTO(const struct net_device *dev, unsigned long before,
+		 unsigned long after),
+	TP_ARGS(dev, before, after),
+
+	TP_STRUCT__entry(
+		__array(char, ifname, IFNAMSIZ)
+		__field(unsigned long, before)
+		__field(unsigned long, after)
+	),
+
+	TP_fast_assign(
+		strscpy(__entry->ifname, dev->name, IFNAMSIZ);
+		__entry->before = before;
+		__entry->after = after;
+	),
+
+	TP_printk("%s: cmds_todo 0x%lx -> 0x%lx, sent 0x%lx",
+		  __entry->ifname, __entry->before, __entry->after,
+		  __entry->before & ~__entry->after)
+);
+
+TRACE_EVENT(can327_uart_side_failure,
+	TP_PROTO(const struct net_device *dev, const char *state),
+	TP_ARGS(dev, state),
+
+	TP_STRUCT__entry(
+		__array(char, ifname, IFNAMSIZ)
+		__array(char, state, CAN327_TRACE_NAME_LEN)
+	),
+
+	TP_fast_assign(
+		strscpy(__entry->ifname, dev->name, IFNAMSIZ);
+		strscpy(__entry->state, state, CAN327_TRACE_NAME_LEN);
+	),
+
+	TP_printk("%s: in state %s", __entry->ifname, __entry->state)
+);
+
+#endif /* _CAN327_TRACE_H */
+
+/* This must be outside the include guard */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE can327_trace
+#include <trace/define_trace.h>
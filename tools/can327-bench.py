@@ -0,0 +1,334 @@
+#!/usr/bin/env python3
+# SPDX-License-Identifier: GPL-2.0
+#
+# End-to-end throughput and latency benchmark for can327, against
+# elm327-emu.py on a pty.
+#
+# Needs root, ldattach, iproute2, and the can327 module loaded:
+#
+#     sudo insmod module/can327.ko
+#     sudo tools/can327-bench.py --baud 115200 --bus-load 800
+#
+# Three phases are run, one after the other on the same channel:
+#
+#   rx  The emulated bus carries --bus-load frames per second.
+#       Reports the frames per second that made it to a CAN_RAW socket,
+#       and how many were dropped, and why.
+#   tx  --tx-frames frames are sent back to back on an idle bus.
+#       Reports the frames per second that arrived at the emulator.
+#   rr  --rr-count OBD requests to 0x7df are sent one by one, each
+#       answered by the emulated ECU after --ecu-latency ms.
+#       Reports the TX latency (socket to emulator) and round trip.
+#
+# Any option not known here is passed on to elm327-emu.py, e.g.
+# --chip clone or --chip-buffer 512. With --corpus, the rx phase
+# replays odd lines from a file instead of regular bus traffic:
+#
+#     sudo tools/can327-bench.py --phases rx \
+#         --corpus tools/parser-corpus.txt --bus-load 200
+
+import argparse
+import fcntl
+import json
+import os
+import socket
+import struct
+import subprocess
+import sys
+import time
+
+N_DEVELOPMENT = 29
+SIOCGIFNAME = 0x8910
+
+CAN_EFF_FLAG = 0x80000000
+CAN_RTR_FLAG = 0x40000000
+CAN_ERR_FLAG = 0x20000000
+CAN_EFF_MASK = 0x1fffffff
+SOL_CAN_RAW = 101
+CAN_RAW_ERR_FILTER = 2
+
+CAN_FRAME = struct.Struct('=IB3x8s')
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+
+
+def now_us():
+    return time.monotonic_ns() // 1000
+
+
+def percentile(values, p):
+    if not values:
+        return float('nan')
+    values = sorted(values)
+    return values[min(len(values) - 1, int(len(values) * p / 100))]
+
+
+class Emulator:
+    def __init__(self, args, extra):
+        cmd = [sys.executable, os.path.join(HERE, 'elm327-emu.py'),
+               '--baud', str(args.baud),
+               '--ecu', '--ecu-latency', str(args.ecu_latency)] + extra
+        self.proc = subprocess.Popen(cmd, stdin=subprocess.PIPE,
+                                     stdout=subprocess.PIPE, text=True)
+        line = self.proc.stdout.readline().split()
+        if len(line) != 2 or line[0] != 'pty':
+            raise RuntimeError('elm327-emu.py did not start')
+        self.pty = line[1]
+
+    def command(self, cmd):
+        self.proc.stdin.write(cmd + '\n')
+        self.proc.stdin.flush()
+
+    def stats(self):
+        self.command('stats')
+        return json.loads(self.proc.stdout.readline())
+
+    def close(self):
+        if self.proc.poll() is None:
+            self.command('quit')
+            try:
+                self.proc.wait(timeout=2)
+            except subprocess.TimeoutExpired:
+                self.proc.kill()
+
+
+class Channel:
+    """The line discipline attached to the emulator's pty."""
+
+    def __init__(self, args, emu):
+        self.ldattach = subprocess.Popen([
+            'ldattach', '--debug', '--speed', str(args.baud),
+            '--eightbits', '--noparity', '--onestopbit',
+            '--iflag', '-ICRNL,INLCR,-IXOFF',
+            str(N_DEVELOPMENT), emu.pty],
+            stdout=subprocess.DEVNULL)
+
+        # Ask the line discipline for its netdev's name
+        fd = os.open(emu.pty, os.O_RDWR | os.O_NOCTTY)
+        try:
+            for _ in range(50):
+                try:
+                    buf = fcntl.ioctl(fd, SIOCGIFNAME, bytes(16))
+                    break
+                except OSError:
+                    time.sleep(0.1)
+            else:
+                raise RuntimeError('line discipline not attached, '
+                                   'is can327 loaded?')
+        finally:
+            os.close(fd)
+        self.ifname = buf.split(b'\0', 1)[0].decode()
+
+        subprocess.run(['ip', 'link', 'set', self.ifname, 'type', 'can',
+                        'bitrate', str(args.bitrate)], check=True)
+        subprocess.run(['ip', 'link', 'set', self.ifname, 'up'],
+                       check=True)
+
+        self.sock = socket.socket(socket.AF_CAN, socket.SOCK_RAW,
+                                  socket.CAN_RAW)
+        self.sock.setsockopt(SOL_CAN_RAW, CAN_RAW_ERR_FILTER,
+                             struct.pack('=I', CAN_EFF_MASK))
+        self.sock.bind((self.ifname,))
+
+    def send(self, can_id, data):
+        frame = CAN_FRAME.pack(can_id, len(data), data.ljust(8, b'\0'))
+        while True:
+            try:
+                self.sock.send(frame)
+                return
+            except OSError as e:
+                # The TX queue is full
+                if e.errno != 105:
+                    raise
+                time.sleep(0.001)
+
+    def recv(self, timeout):
+        self.sock.settimeout(timeout)
+        try:
+            can_id, dlc, data = CAN_FRAME.unpack(self.sock.recv(16))
+        except socket.timeout:
+            return None
+        return can_id, data[:dlc]
+
+    def drain(self):
+        while self.recv(0.05):
+            pass
+
+    def ethtool_stats(self):
+        try:
+            out = subprocess.run(['ethtool', '-S', self.ifname],
+                                 capture_output=True, text=True).stdout
+        except FileNotFoundError:
+            return {}
+        stats = {}
+        for line in out.splitlines()[1:]:
+            name, _, value = line.partition(':')
+            if value.strip().isdigit():
+                stats[name.strip()] = int(value)
+        return stats
+
+    def close(self):
+        self.sock.close()
+        subprocess.run(['ip', 'link', 'set', self.ifname, 'down'])
+        self.ldattach.terminate()
+        self.ldattach.wait()
+
+
+def delta(after, before):
+    return {k: v - before.get(k, 0) for k, v in after.items()
+            if isinstance(v, int)}
+
+
+def bench_rx(args, emu, chan):
+    chan.drain()
+    before = emu.stats()
+    emu.command('load %g' % args.bus_load)
+
+    frames = errors = 0
+    end = time.monotonic() + args.duration
+    while time.monotonic() < end:
+        r = chan.recv(end - time.monotonic())
+        if r is None:
+            break
+        if r[0] & CAN_ERR_FLAG:
+            errors += 1
+        else:
+            frames += 1
+
+    emu.command('load 0')
+    d = delta(emu.stats(), before)
+    bus = d['bus_frames']
+
+    if d['corpus_lines']:
+        print('rx: %d corpus lines replayed in %gs, %d frames and '
+              '%d error frames received'
+              % (d['corpus_lines'], args.duration, frames, errors))
+        return
+
+    print('rx: %d frames on the bus in %gs, %d received, %.1f frames/s'
+          % (bus, args.duration, frames, frames / args.duration))
+    if bus:
+        print('rx: drop rate %.1f%%: %d missed while not monitoring, '
+              '%d cut short by BUFFER FULL (%d times)'
+              % (100.0 * (bus - frames) / bus, d['missed_frames'],
+                 d['buffer_full_frames'], d['buffer_full']))
+    print('rx: %d error frames' % errors)
+
+
+def bench_tx(args, emu, chan):
+    chan.drain()
+    before = emu.stats()
+
+    start = time.monotonic()
+    for i in range(args.tx_frames):
+        chan.send(0x100 + (i & 0xff), struct.pack('>Q', i))
+
+    # Wait for the emulator to catch up
+    deadline = time.monotonic() + 10 + args.tx_frames / 10
+    while time.monotonic() < deadline:
+        s = emu.stats()
+        if s['tx_frames'] - before['tx_frames'] >= args.tx_frames:
+            break
+        time.sleep(0.1)
+    elapsed = time.monotonic() - start
+
+    d = delta(s, before)
+    sent = d['tx_frames']
+    print('tx: %d of %d frames arrived in %.2fs, %.1f frames/s'
+          % (sent, args.tx_frames, elapsed, sent / elapsed))
+    if sent < args.tx_frames:
+        print('tx: drop rate %.1f%%'
+              % (100.0 * (args.tx_frames - sent) / args.tx_frames))
+    chan.drain()
+
+
+def bench_rr(args, emu, chan):
+    chan.drain()
+    tx_lat = []
+    rtt = []
+    lost = 0
+
+    for _ in range(args.rr_count):
+        t = now_us()
+        chan.send(0x7df, b'\x02\x01\x00')
+
+        deadline = time.monotonic() + 1
+        while time.monotonic() < deadline:
+            r = chan.recv(deadline - time.monotonic())
+            if r is None:
+                break
+            can_id, data = r
+            if can_id & ~CAN_EFF_FLAG == 0x7e8 and len(data) == 8:
+                break
+        else:
+            r = None
+
+        if r is None:
+            lost += 1
+            continue
+
+        rtt.append(now_us() - t)
+        seen = struct.unpack('>I', data[3:7])[0]
+        tx_lat.append((seen - t) & 0xffffffff)
+
+    for name, values in (('tx latency', tx_lat), ('round trip', rtt)):
+        print('rr: %s: median %.2fms, p90 %.2fms, p99 %.2fms, max %.2fms'
+              % (name, percentile(values, 50) / 1000,
+                 percentile(values, 90) / 1000,
+                 percentile(values, 99) / 1000,
+                 max(values or [float('nan')]) / 1000))
+    print('rr: %d of %d requests unanswered' % (lost, args.rr_count))
+
+
+def main():
+    p = argparse.ArgumentParser(
+        description='End-to-end benchmark for can327 against '
+        'elm327-emu.py. Unknown options go to the emulator.')
+    p.add_argument('--baud', type=int, default=38400,
+                   help='UART baud rate (default: %(default)s)')
+    p.add_argument('--bitrate', type=int, default=500000,
+                   help='CAN bitrate (default: %(default)s)')
+    p.add_argument('--bus-load', type=float, default=500,
+                   help='frames per second during the rx phase '
+                   '(default: %(default)s)')
+    p.add_argument('--duration', type=float, default=10,
+                   help='length of the rx phase in seconds '
+                   '(default: %(default)s)')
+    p.add_argument('--tx-frames', type=int, default=500,
+                   help='frames to send in the tx phase '
+                   '(default: %(default)s)')
+    p.add_argument('--rr-count', type=int, default=100,
+                   help='requests to send in the rr phase '
+                   '(default: %(default)s)')
+    p.add_argument('--ecu-latency', type=float, default=10,
+                   help='ECU reply delay in ms (default: %(default)s)')
+    p.add_argument('--phases', default='rx,tx,rr',
+                   help='phases to run (default: %(default)s)')
+    args, extra = p.parse_known_args()
+
+    emu = Emulator(args, extra)
+    try:
+        chan = Channel(args, emu)
+        try:
+            # Let the init script finish
+            time.sleep(1)
+            before = chan.ethtool_stats()
+
+            for phase in args.phases.split(','):
+                {'rx': bench_rx, 'tx': bench_tx, 'rr': bench_rr}[phase](
+                    args, emu, chan)
+
+            after = chan.ethtool_stats()
+            d = delta(after, before)
+            for name in ('cmd_mode_kicks', 'prompts', 'tx_prompts',
+                         'tx_frames', 'rx_lines', 'err_buffer_full'):
+                if name in d:
+                    print('driver: %s %d' % (name, d[name]))
+        finally:
+            chan.close()
+    finally:
+        emu.close()
+
+
+if __name__ == '__main__':
+    main()
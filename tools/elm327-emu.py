@@ -0,0 +1,604 @@
+#!/usr/bin/env python3
+# SPDX-License-Identifier: GPL-2.0
+#
+# ELM327/STN emulator on a pty, for testing and benchmarking can327
+# without a car.
+#
+# It speaks the subset of the ELM327 command set that can327 uses,
+# over the slave end of a pty which the line discipline can be
+# attached to, like module/attach-me.sh does for real hardware:
+#
+#     ./elm327-emu.py --baud 38400 --bus-load 300
+#     pty /dev/pts/5
+#     sudo ldattach --debug --speed 38400 --eightbits --noparity \
+#         --onestopbit --iflag -ICRNL,INLCR,-IXOFF 29 /dev/pts/5
+#
+# The UART is emulated by pacing data in both directions to the baud
+# rate. The chip's output buffer is emulated too: If the bus produces
+# more frames than the UART can take while monitoring, the chip says
+# BUFFER FULL and returns to the prompt, just like the real thing.
+#
+# Commands are read from stdin, one per line:
+#     stats       Print the counters as a JSON object on stdout
+#     load <n>    Generate n frames per second on the bus
+#     quit        Exit
+#
+# With --corpus, the bus load is made of canned lines from a file
+# instead, which are printed as they are while monitoring. This is for
+# checking and timing can327's parser on odd input, see
+# parser-corpus.txt.
+#
+# With --ecu, frames to 0x7df and 0x7e0..0x7e7 are answered from
+# 0x7e8.. after --ecu-latency ms. Bytes 3..6 of the reply hold the
+# time the emulator received the request, in microseconds of
+# CLOCK_MONOTONIC, big endian, modulo 2^32. can327-bench.py uses that
+# to tell TX latency apart from the round trip.
+
+import argparse
+import json
+import os
+import random
+import select
+import struct
+import sys
+import time
+import tty
+
+PROMPT = '\r>'
+
+CHIPS = {
+    # ID, AT@1 reply, supports spaces off/DLC (v1.3), RTR, CSM, STN
+    'elm': ('ELM327 v1.4b', 'OBDII to RS232 Interpreter', True, True,
+            True, False),
+    'clone': ('ELM327 v1.5', None, True, False, False, False),
+    'old': ('ELM327 v1.2', 'OBDII to RS232 Interpreter', False, True,
+            True, False),
+    'stn': ('ELM327 v1.4b', 'OBDII to RS232 Interpreter', True, True,
+            True, True),
+}
+
+
+def now_us():
+    return time.monotonic_ns() // 1000
+
+
+class Frame:
+    def __init__(self, can_id, data, eff=False, rtr=False):
+        self.can_id = can_id
+        self.data = bytes(data)
+        self.eff = eff
+        self.rtr = rtr
+
+
+class Uart:
+    """Paces bytes in both directions to 10 bits per byte."""
+
+    def __init__(self, fd, baud):
+        self.fd = fd
+        self.set_baud(baud)
+        self.out = bytearray()
+        self.inq = bytearray()
+        self.last = time.monotonic()
+        self.out_credit = 0.0
+        self.in_credit = 0.0
+
+    def set_baud(self, baud):
+        self.baud = baud
+        self.rate = baud / 10.0
+
+    def write(self, s):
+        self.out += s.encode('latin-1')
+
+    def pending(self):
+        return len(self.out)
+
+    def pump(self, stats):
+        """Move data between the pty and our queues.
+
+        Returns the input bytes that have "arrived" at the chip.
+        """
+        t = time.monotonic()
+        dt = t - self.last
+        self.last = t
+
+        # Don't save up credit while idle, a UART can't do that either
+        self.out_credit = min(self.out_credit + dt * self.rate,
+                              max(1.0, self.rate / 100))
+        n = int(self.out_credit)
+        if n and self.out:
+            try:
+                written = os.write(self.fd, self.out[:n])
+            except BlockingIOError:
+                written = 0
+            del self.out[:written]
+            self.out_credit -= written
+            stats['uart_bytes_out'] += written
+        elif not self.out:
+            self.out_credit = min(self.out_credit, 1.0)
+
+        try:
+            self.inq += os.read(self.fd, 4096)
+        except (BlockingIOError, OSError):
+            pass
+
+        self.in_credit = min(self.in_credit + dt * self.rate,
+                             max(1.0, self.rate / 100))
+        n = min(int(self.in_credit), len(self.inq))
+        arrived = bytes(self.inq[:n])
+        del self.inq[:n]
+        self.in_credit -= n
+        if not self.inq:
+            self.in_credit = min(self.in_credit, 1.0)
+        stats['uart_bytes_in'] += n
+
+        return arrived
+
+
+class Chip:
+    def __init__(self, uart, args):
+        self.uart = uart
+        self.args = args
+        (self.id, self.desc, self.v13, self.rtr_ok, self.csm_ok,
+         self.stn) = CHIPS[args.chip]
+        self.bus_load = args.bus_load
+        self.next_bus_frame = time.monotonic()
+        self.bus_ids = [int(x, 16) for x in args.ids.split(',')]
+        self.corpus = load_corpus(args.corpus) if args.corpus else None
+        self.corpus_pos = 0
+        self.ecu_replies = []   # (due, Frame)
+        self.stats = dict.fromkeys([
+            'bus_frames', 'monitor_frames', 'missed_frames',
+            'buffer_full', 'buffer_full_frames', 'corpus_lines',
+            'tx_frames',
+            'ecu_replies', 'commands', 'unknown_commands',
+            'uart_bytes_in', 'uart_bytes_out'], 0)
+        self.stats['tx_first_us'] = None
+        self.stats['tx_last_us'] = None
+        self.line = ''
+        self.reset()
+
+    def reset(self):
+        self.state = 'cmd'
+        self.echo = True
+        self.headers = False
+        self.spaces = True
+        self.dlc = False
+        self.linefeeds = False
+        self.responses = True
+        self.header = 0x7df
+        self.priority = 0x18
+        self.pb = 0x8101
+        self.timeout = 0x32
+        self.cf = 0
+        self.cm = 0
+        self.cra = None
+        self.pass_filters = []
+        self.protocol = '0'
+        self.last_frame = Frame(0, b'')
+
+    def eol(self):
+        return '\r\n' if self.linefeeds else '\r'
+
+    def out(self, s):
+        self.uart.write(s)
+
+    def reply(self, s):
+        """Answer a command and go back to the prompt."""
+        if s:
+            self.out(s + self.eol())
+        self.out(self.eol() + '>')
+        self.state = 'cmd'
+
+    # Receiving from the host
+
+    def feed(self, data):
+        for c in data.decode('ascii', 'replace'):
+            self.feed_char(c)
+
+    def feed_char(self, c):
+        if self.state in ('monitor', 'replywait'):
+            # Any character stops monitoring or waiting for replies
+            self.reply('STOPPED')
+            return
+
+        if self.state == 'brd_wait_cr':
+            if c == '\r':
+                self.args.baud = self.brd_baud
+                self.reply('OK')
+            return
+
+        if self.state != 'cmd':
+            return
+
+        if self.echo:
+            self.out(c)
+
+        if c == '\r':
+            line = self.line
+            self.line = ''
+            self.command(line)
+        elif c not in '\n\0':
+            self.line += c
+
+    def command(self, line):
+        u = line.replace(' ', '').upper()
+        self.stats['commands'] += 1
+
+        if not u:
+            self.out(PROMPT)
+            return
+
+        if u.startswith('AT'):
+            r = self.at(u[2:])
+        elif u.startswith('ST') and self.stn:
+            r = self.st(u[2:])
+        elif all(c in '0123456789ABCDEF' for c in u) and \
+                len(u) % 2 == 0 and len(u) <= 16:
+            self.transmit(self.make_frame(self.header, bytes.fromhex(u)),
+                          self.responses)
+            return
+        else:
+            r = '?'
+
+        if r == '?':
+            self.stats['unknown_commands'] += 1
+        if r is not None:
+            self.reply(r)
+
+    def at(self, c):
+        flags = {
+            'E0': ('echo', False), 'E1': ('echo', True),
+            'H0': ('headers', False), 'H1': ('headers', True),
+            'L0': ('linefeeds', False), 'L1': ('linefeeds', True),
+            'R0': ('responses', False), 'R1': ('responses', True),
+        }
+        if self.v13:
+            flags.update({
+                'S0': ('spaces', False), 'S1': ('spaces', True),
+                'D0': ('dlc', False), 'D1': ('dlc', True),
+            })
+
+        if c in flags:
+            setattr(self, *flags[c])
+            return 'OK'
+
+        if c in ('WS', 'Z'):
+            self.reset()
+            return '\r\r' + self.id
+        if c == 'I':
+            return self.id
+        if c == '@1':
+            return self.desc or '?'
+        if c == 'DPN':
+            return self.protocol
+        if c in ('TPB', 'SPB'):
+            self.protocol = 'B'
+            return 'OK'
+        if c in ('M0', 'M1', 'AL', 'BI', 'PC', 'PPFFOFF', 'CAF0', 'CAF1',
+                 'CFC0', 'CFC1', 'AT0', 'AT1', 'AT2', 'FCSM1'):
+            return 'OK'
+        if c.startswith('CSM') and len(c) == 4:
+            # Clones accept this, but keep on ACKing.
+            return 'OK'
+        if c.startswith('FCSH') or c.startswith('FCSD'):
+            return 'OK'
+        if c.startswith('SH') and len(c) in (5, 8, 10):
+            v = int(c[2:], 16)
+            if len(c) == 10:
+                self.priority = v >> 24
+                self.header = v & 0xffffff
+            else:
+                self.header = v
+            return 'OK'
+        if c.startswith('CP') and len(c) == 4:
+            self.priority = int(c[2:], 16)
+            return 'OK'
+        if c.startswith('ST') and len(c) == 4:
+            self.timeout = int(c[2:], 16) or 0x32
+            return 'OK'
+        if c.startswith('PB') and len(c) == 6:
+            self.pb = int(c[2:], 16)
+            return 'OK'
+        if c.startswith('CRA'):
+            self.cra = int(c[3:], 16) if len(c) > 3 else None
+            return 'OK'
+        if c.startswith('CF'):
+            self.cf = int(c[2:], 16)
+            return 'OK'
+        if c.startswith('CM'):
+            self.cm = int(c[2:], 16)
+            return 'OK'
+        if c == 'MA':
+            self.state = 'monitor'
+            return None
+        if c == 'RTR':
+            if not self.rtr_ok:
+                return '?'
+            self.transmit(self.make_frame(self.header, b'', rtr=True),
+                          self.responses)
+            return None
+        if c.startswith('BRD') and len(c) == 5:
+            self.brd(int(c[3:], 16))
+            return None
+
+        return '?'
+
+    def st(self, c):
+        if c == 'I':
+            return 'STN1110 v4.0.1'
+        if c == 'MA':
+            self.state = 'monitor'
+            return None
+        if c == 'FCP':
+            self.pass_filters = []
+            return 'OK'
+        if c.startswith('FAP'):
+            pattern, mask = c[3:].split(',')
+            self.pass_filters.append((int(pattern, 16), int(mask, 16)))
+            return 'OK'
+        if c.startswith('PX'):
+            params = dict(p.split(':', 1) for p in c[2:].split(','))
+            h = params.get('H', '%X' % self.header)
+            frame = Frame(int(h, 16), bytes.fromhex(params.get('D', '')),
+                          eff=len(h) > 3)
+            self.transmit(frame, self.responses and
+                          params.get('R', '1') != '0')
+            return None
+
+        return '?'
+
+    def brd(self, divisor):
+        """AT BRD: Confirm, switch, print the ID, and wait for a CR."""
+        if not divisor:
+            self.reply('?')
+            return
+
+        self.out('OK' + self.eol())
+        self.brd_baud = 4000000 // divisor
+        self.brd_old = self.uart.baud
+        self.state = 'brd_switch'
+
+    def brd_tick(self, t):
+        if self.state == 'brd_switch' and not self.uart.pending():
+            self.uart.set_baud(self.brd_baud)
+            self.out(self.id + self.eol())
+            self.state = 'brd_wait_id'
+        elif self.state == 'brd_wait_id' and not self.uart.pending():
+            self.brd_deadline = t + 0.075
+            self.state = 'brd_wait_cr'
+        elif self.state == 'brd_wait_cr' and t > self.brd_deadline:
+            self.uart.set_baud(self.brd_old)
+            self.out(PROMPT)
+            self.state = 'cmd'
+
+    # The CAN side
+
+    def make_frame(self, header, data, rtr=False):
+        eff = not (self.pb & 0x8000)
+        if eff:
+            header |= self.priority << 24
+        return Frame(header, data, eff=eff, rtr=rtr)
+
+    def transmit(self, frame, responses):
+        t = now_us()
+        self.stats['tx_frames'] += 1
+        if self.stats['tx_first_us'] is None:
+            self.stats['tx_first_us'] = t
+        self.stats['tx_last_us'] = t
+
+        if self.args.ecu:
+            reply_id = None
+            if not frame.eff and (frame.can_id == 0x7df or
+                                  0x7e0 <= frame.can_id <= 0x7e7):
+                reply_id = 0x7e8 | (frame.can_id & 7
+                                    if frame.can_id != 0x7df else 0)
+            if reply_id is not None:
+                data = b'\x06\x41\x00' + \
+                    struct.pack('>I', t & 0xffffffff) + b'\x00'
+                due = time.monotonic() + self.args.ecu_latency / 1000.0
+                self.ecu_replies.append((due, Frame(reply_id, data)))
+
+        if responses:
+            self.state = 'replywait'
+            self.replies = 0
+            self.reply_deadline = time.monotonic() + self.timeout * 0.004
+        else:
+            self.out(PROMPT)
+
+    def format(self, frame):
+        sep = ' ' if self.spaces else ''
+        if not self.headers:
+            parts = []
+        elif frame.eff:
+            i = frame.can_id & 0x1fffffff
+            parts = ['%02X' % ((i >> s) & 0xff) for s in (24, 16, 8, 0)]
+        else:
+            parts = ['%03X' % frame.can_id]
+
+        if self.dlc and self.headers:
+            parts.append('%X' % len(frame.data if not frame.rtr
+                                    else self.last_frame.data))
+
+        if frame.rtr:
+            # Clones show the last frame's payload instead
+            if self.rtr_ok:
+                parts.append('RTR')
+            else:
+                parts += ['%02X' % b for b in self.last_frame.data]
+        else:
+            parts += ['%02X' % b for b in frame.data]
+            self.last_frame = frame
+
+        # With spaces on, every field is followed by one, except RTR.
+        if parts and parts[-1] == 'RTR':
+            return sep.join(parts) + self.eol()
+        return ''.join(p + sep for p in parts) + self.eol()
+
+    def passes(self, frame):
+        if self.pass_filters:
+            return any((frame.can_id & m) == (p & m)
+                       for p, m in self.pass_filters)
+        if self.cra is not None:
+            return frame.can_id == self.cra
+        return (frame.can_id & self.cm) == (self.cf & self.cm)
+
+    def show(self, frame):
+        """Print a received frame, if the output buffer has room."""
+        line = self.format(frame)
+        room = self.args.chip_buffer - self.uart.pending()
+
+        if len(line) <= room:
+            self.out(line)
+            return True
+
+        # The line is cut short, and the error appended to it.
+        self.out(line[:max(room, 0)] + 'BUFFER FULL' + self.eol())
+        self.reply('')
+        self.stats['buffer_full'] += 1
+        return False
+
+    def corpus_line(self):
+        line = self.corpus[self.corpus_pos]
+        self.corpus_pos = (self.corpus_pos + 1) % len(self.corpus)
+
+        if self.state != 'monitor':
+            return
+
+        self.stats['corpus_lines'] += 1
+        self.out(line + self.eol())
+        if 'BUFFER FULL' in line:
+            self.reply('')
+
+    def tick(self):
+        t = time.monotonic()
+
+        if self.state.startswith('brd'):
+            self.brd_tick(t)
+
+        # Traffic on the bus, from other nodes
+        if self.bus_load > 0:
+            while self.next_bus_frame <= t:
+                self.next_bus_frame += 1.0 / self.bus_load
+                if self.corpus:
+                    self.corpus_line()
+                    continue
+
+                can_id = random.choice(self.bus_ids)
+                frame = Frame(can_id, os.urandom(8), eff=can_id > 0x7ff)
+                self.stats['bus_frames'] += 1
+
+                if self.state != 'monitor' or not self.passes(frame):
+                    if self.passes(frame):
+                        self.stats['missed_frames'] += 1
+                    continue
+
+                if self.show(frame):
+                    self.stats['monitor_frames'] += 1
+                else:
+                    self.stats['buffer_full_frames'] += 1
+        else:
+            self.next_bus_frame = t
+
+        # Replies from our emulated ECU
+        while self.ecu_replies and self.ecu_replies[0][0] <= t:
+            _, frame = self.ecu_replies.pop(0)
+            self.stats['ecu_replies'] += 1
+            if self.state == 'replywait':
+                self.show(frame)
+                self.replies += 1
+                self.reply_deadline = t + self.timeout * 0.004
+            elif self.state == 'monitor' and self.passes(frame):
+                if self.show(frame):
+                    self.stats['monitor_frames'] += 1
+
+        if self.state == 'replywait' and t > self.reply_deadline:
+            self.reply('' if self.replies else 'NO DATA')
+
+
+def load_corpus(path):
+    """Lines to print as they are, with Python escapes, e.g. \\0."""
+    lines = []
+    with open(path) as f:
+        for line in f:
+            line = line.rstrip('\n')
+            if line and not line.startswith('#'):
+                lines.append(line.encode('ascii').decode('unicode_escape'))
+    return lines
+
+
+def control(chip, line):
+    words = line.split()
+    if not words:
+        return True
+    if words[0] == 'stats':
+        print(json.dumps(chip.stats), flush=True)
+    elif words[0] == 'load' and len(words) == 2:
+        chip.bus_load = float(words[1])
+    elif words[0] == 'quit':
+        return False
+    else:
+        print('unknown command', file=sys.stderr)
+    return True
+
+
+def main():
+    p = argparse.ArgumentParser(
+        description='ELM327/STN emulator on a pty.')
+    p.add_argument('--baud', type=int, default=38400,
+                   help='UART baud rate (default: %(default)s)')
+    p.add_argument('--chip', choices=sorted(CHIPS), default='elm',
+                   help='which chip to emulate (default: %(default)s)')
+    p.add_argument('--chip-buffer', type=int, default=256,
+                   help="size of the chip's UART output buffer in bytes "
+                   '(default: %(default)s)')
+    p.add_argument('--bus-load', type=float, default=0,
+                   help='frames per second from other nodes '
+                   '(default: %(default)s)')
+    p.add_argument('--ids', default='123,7e8,18daf110',
+                   help='CAN IDs of those frames, in hex '
+                   '(default: %(default)s)')
+    p.add_argument('--corpus', metavar='FILE',
+                   help='replay the lines in FILE as the bus load')
+    p.add_argument('--ecu', action='store_true',
+                   help='answer OBD requests to 0x7df, 0x7e0..0x7e7')
+    p.add_argument('--ecu-latency', type=float, default=10,
+                   help='ECU reply delay in ms (default: %(default)s)')
+    args = p.parse_args()
+
+    master, slave = os.openpty()
+    tty.setraw(slave)
+    os.set_blocking(master, False)
+    print('pty', os.ttyname(slave), flush=True)
+
+    uart = Uart(master, args.baud)
+    chip = Chip(uart, args)
+    os.set_blocking(sys.stdin.fileno(), False)
+    stdin_buf = ''
+
+    try:
+        while True:
+            r, _, _ = select.select([master, sys.stdin], [], [], 0.001)
+
+            if sys.stdin in r:
+                data = sys.stdin.read()
+                if not data:
+                    break
+                stdin_buf += data
+                done = False
+                while '\n' in stdin_buf:
+                    line, stdin_buf = stdin_buf.split('\n', 1)
+                    if not control(chip, line):
+                        done = True
+                if done:
+                    break
+
+            chip.feed(uart.pump(chip.stats))
+            chip.tick()
+    except KeyboardInterrupt:
+        pass
+
+    print(json.dumps(chip.stats), flush=True)
+
+
+if __name__ == '__main__':
+    main()